@@ -24,7 +24,7 @@ void buf_write_unchecked(Buffer *b, const char c) {
 }
 
 void buf_append_unchecked(Buffer *b, const char *s, const size_t len) {
-  strncpy(b->buf + b->pos, s, len);
+  memcpy(b->buf + b->pos, s, len);
   (b->buf)[b->pos += len] = '\0';
 }
 
@@ -39,17 +39,18 @@ void buf_append(Buffer *b, const char *s, size_t len) {
 }
 
 void buf_append_csv(Buffer *b, const char *s, size_t len) {
-  size_t i;
-
-  if (! strchr(s, '\"')) {
-    buf_append(b, s, len);
-  } else {
-    buf_check(b, len * 2);
-    for (i=0; i<len; i++) {
-      if (s[i] == '\"') buf_write_unchecked(b, '\"');
-      buf_write_unchecked(b, s[i]);
-    }
+  const char *end = s + len, *q;
+
+  buf_check(b, len * 2);
+
+  // Copy up to and including each quote, then write the quote again.
+  while ((q = memchr(s, '\"', end - s))) {
+    buf_append_unchecked(b, s, q - s + 1);
+    buf_write_unchecked(b, '\"');
+    s = q + 1;
   }
+
+  buf_append_unchecked(b, s, end - s);
 }
 
 ssize_t buf_append_read(Buffer *b, FILE *in) {
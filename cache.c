@@ -0,0 +1,252 @@
+/*
+ * parse cache
+ *****************************************************************************/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+// The forms parsed from an input file, with their tokens, can be saved to a
+// cache file, so that later runs over the same input load them from there
+// instead of parsing the input again. The cache is valid for an input file
+// with the same size, modification time (to the nanosecond) and checksum of
+// all of its contents. It's written to a temporary file, which takes the
+// cache file's place once all of the input has been parsed (see
+// cache_commit()). A valid cache file is mapped into memory and read in place.
+
+// The input is hashed eight bytes at a time in four independent lanes, which
+// is about as fast as it can be read, and far faster than parsing it.
+
+static uint64_t mix(uint64_t h, uint64_t x) {
+  h ^= x * 0x9e3779b97f4a7c15ULL;
+  return (h << 31 | h >> 33) * 0xc2b2ae3d27d4eb4fULL;
+}
+
+static uint64_t input_checksum(int fd, uint64_t size) {
+  char *buf = jmalloc(CACHE_CHUNK);
+  uint64_t lane[4] = {1, 2, 3, 4}, off = 0, x, h = size;
+  size_t i, len;
+  ssize_t n;
+  int k;
+
+  while (off < size && (n = pread(fd, buf, CACHE_CHUNK, off)) > 0) {
+    // Only the last few bytes of the input are hashed one at a time.
+    if (!(len = n & ~(size_t) 31)) {
+      for (i = 0; i < (size_t) n; i++)
+        lane[i & 3] = mix(lane[i & 3], (unsigned char) buf[i]);
+      break;
+    }
+
+    for (i = 0; i < len; i += 32) {
+      for (k = 0; k < 4; k++) {
+        memcpy(&x, buf + i + 8 * k, 8);
+        lane[k] = mix(lane[k], x);
+      }
+    }
+
+    off += len;
+  }
+
+  for (k = 0; k < 4; k++)
+    h = mix(h, lane[k]);
+
+  free(buf);
+  return h;
+}
+
+static size_t pad(size_t n) {
+  return (n + 7) & ~(size_t) 7;
+}
+
+/*
+ * reading
+ *****************************************************************************/
+
+static int cache_load(Cache *c) {
+  CacheHeader *h;
+  struct stat st;
+  int fd;
+
+  if ((fd = open(c->path, O_RDONLY)) < 0) return 0;
+
+  if (fstat(fd, &st) || (size_t) st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  c->size = st.st_size;
+  c->map = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (c->map == MAP_FAILED) {
+    c->map = NULL;
+    return 0;
+  }
+
+  h = (CacheHeader *) c->map;
+
+  if (memcmp(h->magic, c->header.magic, sizeof(h->magic)) || h->version != CACHE_VERSION
+      || h->order != CACHE_ORDER || h->size != c->header.size
+      || h->mtime != c->header.mtime || h->checksum != c->header.checksum
+      || h->bytes != c->size) {
+    munmap(c->map, c->size);
+    c->map = NULL;
+    return 0;
+  }
+
+  madvise(c->map, c->size, MADV_SEQUENTIAL);
+  c->header = *h;
+  c->pos = sizeof(CacheHeader);
+
+  return 1;
+}
+
+// Returns the next form's input and tokens, which stay valid as long as the
+// cache, or zero when there are no more forms.
+
+int cache_next(Cache *c, const char **js, size_t *len, const CacheTok **toks, size_t *n) {
+  CacheForm *f;
+  size_t end;
+
+  if (c->forms == c->header.forms) return 0;
+
+  f = (CacheForm *) (c->map + c->pos);
+  end = c->pos + sizeof(CacheForm);
+
+  if (end > c->size || f->len > c->size || f->toks > c->size
+      || (end += pad(f->len + 1) + sizeof(CacheTok) * f->toks) > c->size)
+    die("corrupt cache file: %s", c->path);
+
+  *js = c->map + c->pos + sizeof(CacheForm);
+  *len = f->len;
+  *toks = (const CacheTok *) (*js + pad(f->len + 1));
+  *n = f->toks;
+
+  c->pos = end;
+  c->forms++;
+
+  return 1;
+}
+
+/*
+ * writing
+ *****************************************************************************/
+
+static void cache_write(Cache *c, const void *s, size_t len, size_t size) {
+  static const char zeros[8] = {0};
+
+  fwrite(s, 1, len, c->out);
+  fwrite(zeros, 1, size - len, c->out);
+}
+
+// Adds a form with its input and the number of tokens, which are then added
+// one at a time with cache_add_tok().
+
+void cache_add(Cache *c, const char *js, size_t len, size_t n) {
+  CacheForm f;
+
+  if (c->failed) return;
+
+  f.len = len;
+  f.toks = n;
+
+  cache_write(c, &f, sizeof(f), sizeof(f));
+  cache_write(c, js, len, pad(len + 1));
+  c->forms++;
+}
+
+void cache_add_tok(Cache *c, const CacheTok *tok) {
+  if (!c->failed) fwrite(tok, sizeof(CacheTok), 1, c->out);
+}
+
+// The cache can't be written, eg. because a form was too large.
+
+void cache_fail(Cache *c) {
+  c->failed = 1;
+}
+
+// Finishes the cache after all of the input was parsed, if it was written
+// and nothing went wrong. Returns whether it was.
+
+int cache_commit(Cache *c) {
+  long end;
+
+  if (!c->out || c->failed || (end = ftell(c->out)) < 0) return 0;
+
+  c->header.forms = c->forms;
+  c->header.bytes = end;
+
+  if (fseek(c->out, 0, SEEK_SET) || fwrite(&(c->header), sizeof(CacheHeader), 1, c->out) != 1
+      || fclose(c->out)) {
+    c->out = NULL;
+    return 0;
+  }
+
+  c->out = NULL;
+
+  if (rename(c->tmp, c->path)) die_err("can't write cache file: %s", c->path);
+
+  return (c->committed = 1);
+}
+
+/*
+ * caches
+ *****************************************************************************/
+
+// Opens the cache for the input stream, which must be a regular file. The
+// cache is read if it's valid, and otherwise written as the input is parsed.
+
+void cache_alloc(Cache **c, const char *path, FILE *in) {
+  struct stat st;
+  mode_t mask;
+  int fd;
+
+  if (fstat(fileno(in), &st) || !S_ISREG(st.st_mode))
+    die("can't cache input that isn't a regular file");
+
+  *c = jmalloc(sizeof(Cache));
+  memset(*c, 0, sizeof(Cache));
+
+  (*c)->path = path;
+  memcpy((*c)->header.magic, CACHE_MAGIC, sizeof((*c)->header.magic));
+  (*c)->header.version = CACHE_VERSION;
+  (*c)->header.order = CACHE_ORDER;
+  (*c)->header.size = st.st_size;
+  (*c)->header.mtime = (int64_t) st.st_mtime * 1000000000 + MTIME_NSEC(st);
+  (*c)->header.checksum = input_checksum(fileno(in), st.st_size);
+
+  if (cache_load(*c)) return;
+
+  (*c)->tmp = jmalloc(strlen(path) + 8);
+  sprintf((*c)->tmp, "%s.XXXXXX", path);
+
+  if ((fd = mkstemp((*c)->tmp)) < 0 || !((*c)->out = fdopen(fd, "w")))
+    die_err("can't create cache file: %s", path);
+
+  // mkstemp() makes a private file, but a cache file is like any other.
+  umask(mask = umask(0));
+  fchmod(fd, 0666 & ~mask);
+
+  setvbuf((*c)->out, NULL, _IOFBF, 1 << 20);
+  cache_write(*c, &((*c)->header), sizeof(CacheHeader), sizeof(CacheHeader));
+}
+
+void cache_free(Cache **c) {
+  if ((*c)->map) munmap((*c)->map, (*c)->size);
+
+  if ((*c)->out) {
+    fclose((*c)->out);
+    unlink((*c)->tmp);
+  }
+
+  free((*c)->tmp);
+  free(*c);
+  *c = NULL;
+}
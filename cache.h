@@ -0,0 +1,80 @@
+/*
+ * parse cache
+ *****************************************************************************/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "util.h"
+
+#define CACHE_MAGIC "jtcache"
+#define CACHE_VERSION 2
+#define CACHE_ORDER 0x01020304
+#define CACHE_CHUNK (1 << 20)
+
+// The cache file starts with a header, followed by a record for each form:
+// a CacheForm, the form's input and a NUL, and then its tokens, each part
+// padded to a multiple of eight bytes.
+
+typedef struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t order;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t checksum;
+  uint64_t forms;
+  uint64_t bytes;
+} CacheHeader;
+
+typedef struct CacheForm {
+  uint64_t len;
+  uint64_t toks;
+} CacheForm;
+
+// A token as it's stored in the cache, in 32 bytes. Offsets are relative to
+// the start of the form and token numbers to the token before the form's
+// first one, plus one in both cases so that zero still means none.
+
+typedef struct CacheTok {
+  uint32_t start;
+  uint32_t end;
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint32_t idx;
+  uint8_t type;
+  uint8_t compact;
+  uint8_t unused[6];
+} CacheTok;
+
+typedef struct Cache {
+  const char *path;
+  CacheHeader header;
+  char *map;
+  size_t size;
+  size_t pos;
+  uint64_t forms;
+  FILE *out;
+  char *tmp;
+  int failed;
+  int committed;
+} Cache;
+
+int cache_next(Cache *c, const char **js, size_t *len, const CacheTok **toks, size_t *n);
+
+void cache_add(Cache *c, const char *js, size_t len, size_t n);
+
+void cache_add_tok(Cache *c, const CacheTok *tok);
+
+void cache_fail(Cache *c);
+
+int cache_commit(Cache *c);
+
+void cache_alloc(Cache **c, const char *path, FILE *in);
+
+void cache_free(Cache **c);
+
+#endif
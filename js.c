@@ -2,8 +2,12 @@
  * JSON parser
  *****************************************************************************/
 
+#include <math.h>
+#include <pthread.h>
 #include "js.h"
 
+#define MAX_DEPTH 20
+
 /*
  * parser helpers
  *****************************************************************************/
@@ -33,6 +37,9 @@ void init_tok(jstok_t *tok) {
   tok->first_child = 0;
   tok->next_sibling = 0;
   tok->parsed = 0;
+  tok->num = 0;
+  tok->compact = 0;
+  tok->numeric = 0;
 }
 
 static size_t js_next_tok(jsparser_t *p) {
@@ -42,9 +49,39 @@ static size_t js_next_tok(jsparser_t *p) {
   return p->curtok;
 }
 
+// Reads more input into the buffer, from memory if the input is mapped (see
+// js_map()), or from the background reader if there is one. Returns zero at
+// the end of the input or if the parser is detached from its input stream.
+
+static ssize_t js_read(jsparser_t *p) {
+  size_t n;
+
+  if (! p->in) return 0;
+
+  if (p->map) {
+    n = p->maplen < BUFSIZ ? p->maplen : BUFSIZ;
+    buf_append(p->js, p->map, n);
+    p->map += n;
+    p->maplen -= n;
+    return n;
+  }
+
+  return p->reader ? reader_read(p->reader, p->js) : buf_append_read(p->js, p->in);
+}
+
+// Makes sure n bytes of input are buffered after the current position, if
+// the input doesn't end first. In line mode a newline ends any token, so no
+// more input is read while there's one ahead: a record on a line of its own
+// is complete as soon as its newline arrives, without waiting for the next.
+
 void js_ensure_buf(jsparser_t *p, size_t n) {
-  while (p->pos + n + 1 >= (p->js)->pos)
-    if (! buf_append_read(p->js, p->in)) break;
+  while (p->pos + n + 1 >= (p->js)->pos) {
+    if (p->lines && memchr(js(p), '\n', (p->js)->pos - p->pos)) break;
+    if (! js_read(p)) {
+      p->starved = 1;
+      break;
+    }
+  }
 }
 
 static size_t js_skip_ws(jsparser_t *p) {
@@ -56,6 +93,7 @@ static size_t js_skip_ws(jsparser_t *p) {
     p->pos++;
   }
 
+  p->ws += p->pos - start;
   return p->pos - start;
 }
 
@@ -107,8 +145,64 @@ int js_is_empty(jstok_t *tok) {
  * JSON parser
  *****************************************************************************/
 
+// Plain string characters are found eight bytes at a time: a word is plain if
+// none of its bytes is a control character, quote, backslash, or (when UTF-8
+// is being validated) a non-ASCII byte.
+
+#define ONES 0x0101010101010101ULL
+#define HIGH 0x8080808080808080ULL
+#define HAS_LESS(x, n) (((x) - ONES * (n)) & ~(x) & HIGH)
+#define HAS_BYTE(x, n) HAS_LESS((x) ^ (ONES * (n)), 1)
+
+static size_t js_scan_plain(jsparser_t *p) {
+  const unsigned char *s = (const unsigned char *) js(p), *q = s;
+  const unsigned char *end = (const unsigned char *) (p->js)->buf + (p->js)->pos;
+  uint64_t x, high = p->utf8 ? HIGH : 0;
+
+  while (end - q >= 8) {
+    memcpy(&x, q, 8);
+    if (HAS_LESS(x, 0x20) | HAS_BYTE(x, '\"') | HAS_BYTE(x, '\\') | (x & high)) break;
+    q += 8;
+  }
+
+  while (q < end && *q >= 0x20 && *q != '\"' && *q != '\\' && !(p->utf8 && *q >= 0x80))
+    q++;
+
+  return q - s;
+}
+
+// Returns the length of the UTF-8 sequence at s, or 0 if it's overlong, a
+// surrogate, above U+10FFFF, or truncated. The input buffer is NUL terminated
+// so a truncated sequence is never read past its end.
+
+static size_t js_utf8_len(const unsigned char *s) {
+  unsigned char lo = 0x80, hi = 0xBF;
+  size_t n, i;
+
+  if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    n = 2;
+  } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    n = 3;
+    if (s[0] == 0xE0) lo = 0xA0;
+    else if (s[0] == 0xED) hi = 0x9F;
+  } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    n = 4;
+    if (s[0] == 0xF0) lo = 0x90;
+    else if (s[0] == 0xF4) hi = 0x8F;
+  } else {
+    return 0;
+  }
+
+  if (s[1] < lo || s[1] > hi) return 0;
+
+  for (i = 2; i < n; i++)
+    if ((s[i] & 0xC0) != 0x80) return 0;
+
+  return n;
+}
+
 static jserr_t js_parse_string(jsparser_t *p, size_t t) {
-  size_t start = p->pos, j;
+  size_t start = p->pos, j, n;
 
   js_ensure_buf(p, 2);
   if (js(p)[0] != '"') return JS_EPARSE;
@@ -116,9 +210,19 @@ static jserr_t js_parse_string(jsparser_t *p, size_t t) {
 
   for (; js(p)[0] != '\"'; p->pos++) {
     js_ensure_buf(p, 6);
+
+    if ((n = js_scan_plain(p))) {
+      p->pos += n;
+      js_ensure_buf(p, 6);
+      if (js(p)[0] == '\"') break;
+    }
+
     if (0 <= js(p)[0] && js(p)[0] < 32) return JS_EPARSE;
 
-    if (js(p)[0] == '\\') {
+    if (js(p)[0] < 0 && p->utf8) {
+      if (!(n = js_utf8_len((const unsigned char *) js(p)))) return JS_EUTF8;
+      p->pos += n - 1;
+    } else if (js(p)[0] == '\\') {
       p->pos++;
       switch(js(p)[0]) {
         case '\"':
@@ -142,7 +246,6 @@ static jserr_t js_parse_string(jsparser_t *p, size_t t) {
   }
 
   if (js(p)[0] != '\"') return JS_EPARSE;
-  else *((p->js)->buf + p->pos) = '\0';
   p->pos++;
 
   js_tok(p, t)->type = JS_STRING;
@@ -152,6 +255,76 @@ static jserr_t js_parse_string(jsparser_t *p, size_t t) {
   return 0;
 }
 
+// Converts the text of a number token to a double. Integers of up to 19
+// digits are converted exactly, and so are numbers whose significand and power
+// of ten are both exactly representable: one multiplication or division of
+// exact values is correctly rounded. Anything else is left to strtod().
+
+static const double js_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double js_number(const char *s, size_t len) {
+  const char *q = s, *end = s + len;
+  uint64_t m = 0;
+  int neg = 0, digits = 0, e = 0, esign = 1, ex = 0;
+  char tmp[64], *big;
+  double x;
+
+  if (*q == '-') {
+    neg = 1;
+    q++;
+  }
+
+  for (; q < end && is_digit_char(*q); q++, digits++)
+    m = m * 10 + (*q - '0');
+
+  if (q < end && *q == '.')
+    for (q++; q < end && is_digit_char(*q); q++, digits++, e--)
+      m = m * 10 + (*q - '0');
+
+  if (q < end) {
+    if (*++q == '+' || *q == '-') esign = (*q++ == '-') ? -1 : 1;
+    for (; q < end && ex < 10000; q++) ex = ex * 10 + (*q - '0');
+    e += esign * ex;
+  }
+
+  if (digits <= 19 && (e == 0 || (m <= (1ULL << 53) && e >= -22 && e <= 22))) {
+    x = (double) m;
+    x = (e < 0) ? x / js_pow10[-e] : x * js_pow10[e];
+    return neg ? -x : x;
+  }
+
+  if (len < sizeof(tmp)) {
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    return strtod(tmp, NULL);
+  }
+
+  big = jmalloc(len + 1);
+  memcpy(big, s, len);
+  big[len] = '\0';
+  x = strtod(big, NULL);
+  free(big);
+
+  return x;
+}
+
+// The value of a number token is converted the first time it's needed and kept
+// on the token, so numbers that are never used as numbers cost nothing.
+
+double js_num(jsparser_t *p, size_t t) {
+  jstok_t *tok = js_tok(p, t);
+
+  if (!tok->numeric) {
+    tok->num = js_number(js_buf(p, t), js_len(p, t));
+    tok->numeric = 1;
+  }
+
+  return tok->num;
+}
+
 static jserr_t js_parse_primitive(jsparser_t *p, size_t t) {
   size_t start = p->pos;
   jstype_t type;
@@ -192,9 +365,48 @@ static jserr_t js_parse_primitive(jsparser_t *p, size_t t) {
   return 0;
 }
 
+static jserr_t js_parse_member(jsparser_t *p, size_t t, jstype_t type, size_t prev,
+                               size_t *member) {
+  size_t key = js_next_tok(p), val = js_next_tok(p);
+  jserr_t err;
+
+  if (prev) js_tok(p, prev)->next_sibling = key;
+  else if (t) js_tok(p, t)->first_child = key;
+
+  js_tok(p, key)->parent = t;
+  js_tok(p, key)->first_child = val;
+
+  js_tok(p, val)->parent = key;
+
+  switch (type) {
+    case JS_ARRAY:
+      js_tok(p, key)->type = JS_ITEM;
+      js_tok(p, key)->idx = prev ? js_tok(p, prev)->idx + 1 : 0;
+      break;
+    case JS_OBJECT:
+      if ((err = js_parse_string(p, key))) return err;
+      js_tok(p, key)->type = JS_PAIR;
+      js_skip_ws(p);
+      if (js(p)[0] != ':') return JS_EPARSE;
+      p->pos++;
+      break;
+    default:
+      return JS_EBUG;
+  }
+
+  *member = key;
+
+  return js_parse(p, val);
+}
+
+// Collection tokens span the input from the opening bracket to just past the
+// closing one, so they can be printed by copying the input. A collection is
+// compact if no whitespace was skipped while parsing it.
+
 static jserr_t js_parse_collection(jsparser_t *p, size_t t) {
-  size_t err, key, val, prev = 0;
+  size_t prev = 0, pos = p->pos, ws = p->ws;
   char start, end;
+  jserr_t err;
 
   p->depth--;
   if (!p->depth) return JS_EPARSE;
@@ -224,39 +436,15 @@ static jserr_t js_parse_collection(jsparser_t *p, size_t t) {
         js_skip_ws(p);
       }
 
-      key = js_next_tok(p);
-      val = js_next_tok(p);
-
-      if (prev) js_tok(p, prev)->next_sibling = key;
-      else js_tok(p, t)->first_child = key;
-
-      js_tok(p, key)->parent = t;
-      js_tok(p, key)->first_child = val;
-
-      js_tok(p, val)->parent = key;
-
-      switch (js_tok(p, t)->type) {
-        case JS_ARRAY:
-          js_tok(p, key)->type = JS_ITEM;
-          js_tok(p, key)->idx = prev ? js_tok(p, prev)->idx + 1 : 0;
-          break;
-        case JS_OBJECT:
-          if ((err = js_parse_string(p, key))) return err;
-          js_tok(p, key)->type = JS_PAIR;
-          js_skip_ws(p);
-          if (js(p)[0] != ':') return JS_EPARSE;
-          p->pos++;
-          break;
-        default:
-          return JS_EBUG;
-      }
-
-      prev = key;
-
-      if ((err = js_parse(p, val))) return err;
+      if ((err = js_parse_member(p, t, js_tok(p, t)->type, prev, &prev)))
+        return err;
     }
   }
 
+  js_tok(p, t)->start = pos;
+  js_tok(p, t)->end = p->pos;
+  js_tok(p, t)->compact = (p->ws == ws);
+
   return 0;
 }
 
@@ -274,273 +462,1652 @@ jserr_t js_parse(jsparser_t *p, size_t t) {
   }
 }
 
+// When more input may be fed to the parser later, a form is incomplete if the
+// parser ran out of input while parsing it, unless it's a string or collection
+// which parsed successfully. A number might just have more digits to come. The
+// parser is then rolled back to the start of the form.
+
 jserr_t js_parse_one(jsparser_t *p, size_t *t) {
+  size_t pos, curtok, depth;
+  jserr_t err;
+
   js_skip_ws(p);
-  return (js(p)[0] == '\0') ? JS_EDONE : js_parse(p, (*t = js_next_tok(p)));
-}
 
-/*
- * create JSON primitives
- *****************************************************************************/
+  if (js(p)[0] == '\0') return p->more ? JS_EMORE : JS_EDONE;
 
-size_t js_create_index(jsparser_t *p, size_t idx) {
-  size_t item = js_next_tok(p);
-  js_tok(p, item)->type = JS_ITEM;
-  js_tok(p, item)->idx  = idx;
-  return item;
-}
+  pos = p->mark = p->pos;
+  curtok = p->curtok;
+  depth = p->depth;
+  p->starved = 0;
 
-/*
- * accessors
- *****************************************************************************/
+  err = js_parse(p, (*t = js_next_tok(p)));
 
-size_t js_obj_get(jsparser_t *p, size_t obj, const char *key) {
-  size_t v;
-  jstok_t *tmp;
-  for(v = js_tok(p, obj)->first_child; v; v = js_tok(p, v)->next_sibling) {
-    tmp = js_tok(p, v);
-    if (!strcmp(key, (p->js)->buf + tmp->start))
-      return js_tok(p, v)->first_child;
+  if (p->more && p->starved && (err || js_tok(p, *t)->type == JS_NUMBER)) {
+    p->pos = pos;
+    p->curtok = curtok;
+    p->depth = depth;
+    return JS_EMORE;
   }
-  return 0;
-}
 
-size_t js_array_get(jsparser_t *p, size_t ary, size_t idx) {
-  size_t i, v;
-  if (idx == SIZE_MAX) return 0;
-  v = js_tok(p, ary)->first_child;
-  for (i = 0; i < idx && v; i++)
-    v = js_tok(p, v)->next_sibling;
-  return i == idx ? js_tok(p, v)->first_child : 0;
+  return err;
 }
 
 /*
- * JSON printer
+ * line scanning
  *****************************************************************************/
 
-jserr_t js_print(jsparser_t *p, size_t t, Buffer *b, int json, int csv) {
-  jstok_t *tok = js_tok(p, t);
-  char digitbuf[10];
-  size_t v;
+// Newline delimited JSON can be skipped a line at a time without parsing it.
+// Lines are scanned in the input buffer, which is reset as they go by so that
+// a long line doesn't have to fit in memory. Returns zero if the input ended
+// before a newline was found.
 
-  json = json ? 1 : (js_is_collection(js_tok(p, t)) ? 1 : 0);
+static int js_skip_to_eol(jsparser_t *p) {
+  const char *nl;
 
-  switch (tok->type) {
-    case JS_ARRAY:
-      buf_write(b, '[');
-      v = tok->first_child;
-      while (v) {
-        if (v != tok->first_child)
-          buf_write(b, ',');
-        js_print(p, v, b, json, csv);
-        v = js_tok(p, v)->next_sibling;
-      }
-      buf_write(b, ']');
-      break;
-    case JS_OBJECT:
-      buf_write(b, '{');
-      v = tok->first_child;
-      while (v) {
-        if (v != tok->first_child)
-          buf_write(b, ',');
-        js_print(p, v, b, json, csv);
-        v = js_tok(p, v)->next_sibling;
-      }
-      buf_write(b, '}');
-      break;
-    case JS_PAIR:
-      if (!json) {
-        if (csv) {
-          js_unescape_string(b, js_buf(p, t), js_len(p, t), csv);
-        } else {
-          buf_append(b, js_buf(p, t), js_len(p, t));
-        }
-      } else {
-        buf_write(b, '\"');
-        if (csv) {
-          buf_write(b, '\"');
-          buf_append_csv(b, js_buf(p, t), js_len(p, t));
-          buf_write(b, '\"');
-        } else {
-          buf_append(b, js_buf(p, t), js_len(p, t));
-        }
-        buf_write(b, '\"');
-        buf_write(b, ':');
-        js_print(p, tok->first_child, b, json, csv);
-      }
-      break;
-    case JS_ITEM:
-      if (!json) {
-        snprintf(digitbuf, 10, "%zu", tok->idx);
-        buf_append(b, digitbuf, strlen(digitbuf));
-      } else {
-        js_print(p, tok->first_child, b, json, csv);
-      }
-      break;
-    case JS_STRING:
-      if (json) {
-        buf_write(b, '\"');
-        if (csv) buf_write(b, '\"');
-      }
-      if (csv) {
-        if (json) {
-          buf_append_csv(b, js_buf(p, t), js_len(p, t));
-        } else {
-          js_unescape_string(b, js_buf(p, t), js_len(p, t), csv);
-        }
-      } else {
-        buf_append(b, (p->js)->buf + tok->start, tok->end - tok->start);
-      }
-      if (json) {
-        buf_write(b, '\"');
-        if (csv) buf_write(b, '\"');
-      }
-      break;
-    case JS_NULL:
-    case JS_TRUE:
-    case JS_FALSE:
-    case JS_NUMBER:
-      buf_append(b, (p->js)->buf + tok->start, tok->end - tok->start);
-      break;
-    default:
-      return JS_EBUG;
+  while (! (nl = memchr(js(p), '\n', (p->js)->pos - p->pos))) {
+    p->pos = (p->js)->pos;
+    js_reset(p);
+    if (! js_read(p)) return 0;
   }
 
-  return 0;
+  p->pos = nl + 1 - (p->js)->buf;
+  return 1;
 }
 
-jserr_t js_print_info(jsparser_t *p, size_t t, Buffer *b) {
-  jstok_t *tmp;
-  size_t v;
+// A parser fed from memory can only skip a line once all of it has arrived.
 
-  switch (js_tok(p, t)->type) {
-    case JS_OBJECT:
-      v = js_tok(p, t)->first_child;
-      while (v) {
-        tmp = js_tok(p, v);
-        buf_append(b, (p->js)->buf + tmp->start, tmp->end - tmp->start);
-        if ((v = js_tok(p, v)->next_sibling)) buf_write(b, '\n');
-      }
-      break;
-    case JS_ARRAY:
-      buf_append(b, "[array]", strlen("[array]"));
-      break;
-    case JS_STRING:
-      buf_append(b, "[string]", strlen("[string]"));
-      break;
-    case JS_NUMBER:
-      buf_append(b, "[number]", strlen("[number]"));
-      break;
-    case JS_TRUE:
-    case JS_FALSE:
-      buf_append(b, "[boolean]", strlen("[boolean]"));
-      break;
-    case JS_NULL:
-      buf_append(b, "[null]", strlen("[null]"));
-      break;
-    case JS_NONE:
-      buf_append(b, "[none]", strlen("[none]"));
-      break;
-    default:
-      return JS_EBUG;
+static jserr_t js_skip_line(jsparser_t *p) {
+  const char *nl;
+
+  js_skip_ws(p);
+
+  if (js(p)[0] == '\0') return p->more ? JS_EMORE : JS_EDONE;
+
+  if (! p->in && p->more) {
+    if (! (nl = memchr(js(p), '\n', (p->js)->pos - p->pos))) return JS_EMORE;
+    p->pos = nl + 1 - (p->js)->buf;
+    return 0;
   }
 
+  js_skip_to_eol(p);
   return 0;
 }
 
-/*
- * json string unescaping
- *****************************************************************************/
+// Skips the next n lines of input. Returns the number of lines skipped, which
+// is less than n at the end of the input.
 
-static unsigned long js_read_u_escaped(char **s) {
-  unsigned long p;
-  if (**s == '\\') *s += 2; // skip the \u if necessary
-  sscanf(*s, "%4lx", &p);
-  *s += 4;
-  return p;
+size_t js_skip_lines(jsparser_t *p, size_t n) {
+  size_t i;
+  for (i = 0; i < n && ! js_skip_line(p); i++);
+  return i;
 }
 
-static unsigned long js_read_code_point(char **s) {
-  unsigned long cp = js_read_u_escaped(s);
-  return (cp >= 0xd800 && cp <= 0xdfff) // utf-16 surrogate pair
-    ? (((cp - 0xd800) & 0x3ff) << 10 | ((js_read_u_escaped(s) - 0xdc00) & 0x3ff)) + 0x10000
-    : cp;
-}
+// Appends the next non-blank line of input to b, without the newline. Returns
+// zero at the end of the input.
 
-static unsigned long utf_tag[4] = { 0x00, 0xc0, 0xe0, 0xf0 };
+int js_read_line(jsparser_t *p, Buffer *b) {
+  const char *nl;
 
-static void js_encode_u_escaped(Buffer *b, char **in, int csv) {
-  char buf[4];
-  unsigned long p = js_read_code_point(in);
-  int width = (p < 0x80) ? 1 : (p < 0x800) ? 2 : (p < 0x10000) ? 3 : 4;
+  js_skip_ws(p);
 
-  switch (width) {
-    case 4: buf[3] = ((p | 0x80) & 0xbf); p >>= 6;
-    case 3: buf[2] = ((p | 0x80) & 0xbf); p >>= 6;
-    case 2: buf[1] = ((p | 0x80) & 0xbf); p >>= 6;
-    case 1: buf[0] =  (p | utf_tag[width - 1]);
-  }
+  if (js(p)[0] == '\0') return 0;
 
-  if (csv && width == 1 && buf[0] == '\"') {
-    buf[1] = '\"';
-    width++;
+  while (! (nl = memchr(js(p), '\n', (p->js)->pos - p->pos))) {
+    buf_append(b, js(p), (p->js)->pos - p->pos);
+    p->pos = (p->js)->pos;
+    js_reset(p);
+    if (! js_read(p)) return 1;
   }
 
-  buf_append_unchecked(b, buf, width);
+  buf_append(b, js(p), nl - js(p));
+  p->pos = nl + 1 - (p->js)->buf;
+  return 1;
 }
 
-void js_unescape_string(Buffer *b, char *in, size_t len, int csv) {
-  char *inp = in, *endp = in + len;
-
-  buf_check(b, len);
+// In sampling mode only every sample-th form is parsed, and the lines in
+// between are skipped. Skipped forms are counted, so the index of a form is
+// still its line number in the input.
 
-  while (inp < endp && *inp != '\0') {
-    if (*inp == '\"' || (0 <= *inp && *inp < 32))
-      die("can't parse JSON");
+static jserr_t js_sample(jsparser_t *p) {
+  jserr_t err;
 
-    if (*inp != '\\') {
-      buf_write_unchecked(b, *(inp++));
-    } else {
-      if (csv && *(inp + 1) == '\"')
-        buf_write_unchecked(b, '\"');
-      switch(*(++inp)) {
-        case 'b': buf_write_unchecked(b, '\b'); inp++; break;
-        case 'f': buf_write_unchecked(b, '\f'); inp++; break;
-        case 'n': buf_write_unchecked(b, '\n'); inp++; break;
-        case 'r': buf_write_unchecked(b, '\r'); inp++; break;
-        case 't': buf_write_unchecked(b, '\t'); inp++; break;
-        case 'u': inp++; js_encode_u_escaped(b, &inp, csv); break;
-        case '\"': case '\\': case '/': buf_write_unchecked(b, *(inp++)); break;
-        default: die("can't parse JSON");
-      }
-    }
+  while (p->forms % p->sample) {
+    if ((err = js_skip_line(p))) return err;
+    p->forms++;
   }
+
+  return 0;
 }
 
 /*
- * parser housekeeping
+ * key scanner
  *****************************************************************************/
 
-#define MAX_DEPTH 20
+// When the queries only search a form for the members with a certain key (see
+// the `**` command in jt.c), the form is scanned instead: it's validated just
+// like it is when parsed, but every key and primitive outside of the matching
+// members' values is parsed into the same scratch token. The form's token is
+// an object that spans the whole form and holds only the outermost matching
+// members, so the matches nested in them are found by searching their values.
 
-void js_reset(jsparser_t *p) {
-  p->curtok = 1;
+static jserr_t js_scan(jsparser_t *p, size_t len, size_t root, size_t tmp, size_t *tail) {
+  size_t key, val;
+  int first = 1;
+  jserr_t err;
+  char end;
+
+  js_skip_ws(p);
+
+  switch (js(p)[0]) {
+    case '[': end = ']'; break;
+    case '{': end = '}'; break;
+    case '\"': return js_parse_string(p, tmp);
+    default: return js_parse_primitive(p, tmp);
+  }
+
+  p->depth--;
+  if (!p->depth) return JS_EPARSE;
+
+  for (p->pos++; ; first = 0) {
+    js_skip_ws(p);
+
+    if (js(p)[0] == end) break;
+
+    if (!first) {
+      if (js(p)[0] != ',') return JS_EPARSE;
+      p->pos++;
+      js_skip_ws(p);
+    }
+
+    if (end == '}') {
+      if ((err = js_parse_string(p, tmp))) return err;
+      js_skip_ws(p);
+      if (js(p)[0] != ':') return JS_EPARSE;
+      p->pos++;
+
+      if (js_len(p, tmp) == len && !memcmp(js_buf(p, tmp), p->scan, len)) {
+        key = js_next_tok(p);
+        val = js_next_tok(p);
+        js_tok(p, key)->type = JS_PAIR;
+        js_tok(p, key)->start = js_tok(p, tmp)->start;
+        js_tok(p, key)->end = js_tok(p, tmp)->end;
+        js_tok(p, key)->parent = root;
+        js_tok(p, key)->first_child = val;
+        js_tok(p, val)->parent = key;
+
+        if (*tail) js_tok(p, *tail)->next_sibling = key;
+        else js_tok(p, root)->first_child = key;
+        *tail = key;
+
+        if ((err = js_parse(p, val))) return err;
+        continue;
+      }
+    }
+
+    if ((err = js_scan(p, len, root, tmp, tail))) return err;
+  }
+
+  p->pos++;
+  p->depth++;
+
+  return 0;
+}
+
+static jserr_t js_scan_one(jsparser_t *p, size_t *t) {
+  size_t pos = p->pos, curtok = p->curtok, depth = p->depth, ws = p->ws, tail = 0;
+  jserr_t err;
+
+  p->starved = 0;
+  *t = js_next_tok(p);
+
+  err = js_scan(p, strlen(p->scan), *t, js_next_tok(p), &tail);
+
+  if (p->more && p->starved && err) {
+    p->pos = pos;
+    p->curtok = curtok;
+    p->depth = depth;
+    return JS_EMORE;
+  }
+
+  js_tok(p, *t)->type = JS_OBJECT;
+  js_tok(p, *t)->start = pos;
+  js_tok(p, *t)->end = p->pos;
+  js_tok(p, *t)->compact = (p->ws == ws);
+
+  return err;
+}
+
+/*
+ * MessagePack and CBOR decoders
+ *****************************************************************************/
+
+// MessagePack and CBOR input is decoded into the same tokens as JSON. Each
+// form is written to the input buffer as compact JSON while it's decoded, and
+// its tokens point into that text, so the rest of jt can't tell the
+// difference. The binary input is read from the mapped input file, or into a
+// buffer of its own (see js_detect()). Numbers keep their decoded values, so
+// they're never converted back from text. Byte strings become base64 strings,
+// map keys that are numbers become strings, and floats that aren't finite
+// become null.
+
+#define JS_INDEFINITE ((size_t) -1)
+
+typedef jserr_t (*jsdecoder_t)(jsparser_t *p, size_t t);
+
+static const unsigned char *js_bin(jsparser_t *p) {
+  return (const unsigned char *) (p->map ? p->map : (p->raw)->buf) + p->binpos;
+}
+
+static size_t js_bin_len(jsparser_t *p) {
+  return p->map ? p->maplen : (p->raw)->pos;
+}
+
+// Makes sure n bytes of input are buffered after the current position.
+// Returns zero if the input ends first.
+
+static int js_bin_need(jsparser_t *p, size_t n) {
+  while (js_bin_len(p) - p->binpos < n) {
+    if (! p->in || p->map) return 0;
+    if ((p->reader ? reader_read(p->reader, p->raw) : buf_append_read(p->raw, p->in)) <= 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+static int js_bin_uint(jsparser_t *p, size_t n, uint64_t *u) {
+  const unsigned char *s;
+  size_t i;
+
+  if (! js_bin_need(p, n)) return 0;
+
+  s = js_bin(p);
+  for (*u = 0, i = 0; i < n; i++)
+    *u = (*u << 8) | s[i];
+  p->binpos += n;
+
+  return 1;
+}
+
+// Numbers are written with the fewest significant digits that convert back to
+// the same double, or to the same float for single precision numbers.
+
+static int js_format_number(char *tmp, size_t size, double x, int single) {
+  int prec, n;
+  double y;
+
+  for (prec = single ? 6 : 15; ; prec++) {
+    n = snprintf(tmp, size, "%.*g", prec, x);
+    y = strtod(tmp, NULL);
+    if (prec == (single ? 9 : 17) || (single ? (float) y == (float) x : y == x)) break;
+  }
+
+  return n;
+}
+
+static void js_emit(jsparser_t *p, size_t t, jstype_t type, const char *s, size_t len) {
+  js_tok(p, t)->type = type;
+  js_tok(p, t)->start = (p->js)->pos;
+  buf_append(p->js, s, len);
+  js_tok(p, t)->end = (p->js)->pos;
+}
+
+static jserr_t js_emit_int(jsparser_t *p, size_t t, int neg, uint64_t u) {
+  char tmp[24], *s = tmp + sizeof(tmp);
+  uint64_t m = u;
+
+  do {
+    *--s = '0' + m % 10;
+  } while (m /= 10);
+
+  if (neg) *--s = '-';
+
+  js_emit(p, t, JS_NUMBER, s, tmp + sizeof(tmp) - s);
+  js_tok(p, t)->num = neg ? -(double) u : (double) u;
+  js_tok(p, t)->numeric = 1;
+
+  return 0;
+}
+
+static jserr_t js_emit_float(jsparser_t *p, size_t t, double x, int single) {
+  char tmp[32];
+
+  if (!isfinite(x)) {
+    js_emit(p, t, JS_NULL, "null", 4);
+    return 0;
+  }
+
+  js_emit(p, t, JS_NUMBER, tmp, js_format_number(tmp, sizeof(tmp), x, single));
+  js_tok(p, t)->num = x;
+  js_tok(p, t)->numeric = 1;
+
+  return 0;
+}
+
+static jserr_t js_emit_bool(jsparser_t *p, size_t t, int x) {
+  if (x) js_emit(p, t, JS_TRUE, "true", 4);
+  else js_emit(p, t, JS_FALSE, "false", 5);
+  return 0;
+}
+
+// String tokens span the text between the quotes, which is written by
+// js_open_string() and js_close_string() around the escaped contents.
+
+static void js_open_string(jsparser_t *p, size_t t) {
+  buf_write(p->js, '\"');
+  js_tok(p, t)->type = JS_STRING;
+  js_tok(p, t)->start = (p->js)->pos;
+}
+
+static void js_close_string(jsparser_t *p, size_t t) {
+  js_tok(p, t)->end = (p->js)->pos;
+  buf_write(p->js, '\"');
+}
+
+// Writes n bytes of input as the contents of a JSON string, escaped. Runs of
+// plain characters are found eight bytes at a time and copied in one piece.
+
+static jserr_t js_write_string(jsparser_t *p, size_t n) {
+  const unsigned char *s, *q, *end;
+  uint64_t x, high = p->utf8 ? HIGH : 0;
+  unsigned char seq[4];
+  char esc[8];
+  size_t len;
+
+  if (! js_bin_need(p, n)) return JS_EDECODE;
+
+  s = js_bin(p);
+  end = s + n;
+  p->binpos += n;
+
+  while (s < end) {
+    for (q = s; end - q >= 8; q += 8) {
+      memcpy(&x, q, 8);
+      if (HAS_LESS(x, 0x20) | HAS_BYTE(x, '\"') | HAS_BYTE(x, '\\') | (x & high)) break;
+    }
+
+    while (q < end && *q >= 0x20 && *q != '\"' && *q != '\\' && !(p->utf8 && *q >= 0x80))
+      q++;
+
+    buf_append(p->js, (const char *) s, q - s);
+    if (q == end) break;
+
+    if (*q >= 0x80) {
+      // The string isn't NUL terminated, so the sequence is checked in a copy.
+      memset(seq, 0, sizeof(seq));
+      memcpy(seq, q, (end - q < 4) ? end - q : 4);
+      if (! (len = js_utf8_len(seq))) return JS_EUTF8;
+      buf_append(p->js, (const char *) q, len);
+      s = q + len;
+      continue;
+    }
+
+    switch (*q) {
+      case '\"': buf_append(p->js, "\\\"", 2); break;
+      case '\\': buf_append(p->js, "\\\\", 2); break;
+      case '\b': buf_append(p->js, "\\b", 2);  break;
+      case '\f': buf_append(p->js, "\\f", 2);  break;
+      case '\n': buf_append(p->js, "\\n", 2);  break;
+      case '\r': buf_append(p->js, "\\r", 2);  break;
+      case '\t': buf_append(p->js, "\\t", 2);  break;
+      default:
+        snprintf(esc, sizeof(esc), "\\u%04x", *q);
+        buf_append(p->js, esc, 6);
+    }
+
+    s = q + 1;
+  }
+
+  return 0;
+}
+
+static void js_write_base64(Buffer *b, const unsigned char *s, size_t n) {
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t x;
+  size_t i;
+
+  for (i = 0; i < n; i += 3) {
+    x = (uint32_t) s[i] << 16;
+    if (i + 1 < n) x |= (uint32_t) s[i + 1] << 8;
+    if (i + 2 < n) x |= s[i + 2];
+    buf_write(b, digits[x >> 18]);
+    buf_write(b, digits[(x >> 12) & 63]);
+    buf_write(b, (i + 1 < n) ? digits[(x >> 6) & 63] : '=');
+    buf_write(b, (i + 2 < n) ? digits[x & 63] : '=');
+  }
+}
+
+static jserr_t js_decode_string(jsparser_t *p, size_t t, size_t n, int bytes) {
+  jserr_t err;
+
+  js_open_string(p, t);
+
+  if (! bytes) {
+    if ((err = js_write_string(p, n))) return err;
+  } else {
+    if (! js_bin_need(p, n)) return JS_EDECODE;
+    js_write_base64(p->js, js_bin(p), n);
+    p->binpos += n;
+  }
+
+  js_close_string(p, t);
+
+  return 0;
+}
+
+// Map keys must be strings in JSON, so a key that's a number is quoted.
+
+static jserr_t js_decode_key(jsparser_t *p, size_t key, jsdecoder_t decode) {
+  Buffer *b = p->js;
+  jstok_t *tok;
+  jserr_t err;
+
+  if ((err = decode(p, key))) return err;
+
+  tok = js_tok(p, key);
+
+  if (tok->type == JS_NUMBER) {
+    buf_write(b, '\"');
+    buf_write(b, '\"');
+    memmove(b->buf + tok->start + 1, b->buf + tok->start, tok->end - tok->start);
+    b->buf[tok->start++] = '\"';
+    b->buf[++tok->end] = '\"';
+    tok->numeric = 0;
+  } else if (tok->type != JS_STRING) {
+    return JS_EDECODE;
+  }
+
+  tok->type = JS_PAIR;
+  buf_write(b, ':');
+
+  return 0;
+}
+
+// Decodes the n members of an array or map, or members up to a break code
+// (0xff) when n is JS_INDEFINITE, linking them the way js_parse_member() does.
+
+static jserr_t js_decode_members(jsparser_t *p, size_t t, jstype_t type, size_t n,
+                                 jsdecoder_t decode) {
+  size_t i, key, val, prev = 0, start = (p->js)->pos;
+  jserr_t err;
+
+  if (! --p->depth) return JS_EDECODE;
+
+  js_tok(p, t)->type = type;
+  buf_write(p->js, (type == JS_ARRAY) ? '[' : '{');
+
+  for (i = 0; i < n; i++) {
+    if (n == JS_INDEFINITE) {
+      if (! js_bin_need(p, 1)) return JS_EDECODE;
+      if (js_bin(p)[0] == 0xff) {
+        p->binpos++;
+        break;
+      }
+    }
+
+    if (i) buf_write(p->js, ',');
+
+    key = js_next_tok(p);
+    val = js_next_tok(p);
+
+    if (prev) js_tok(p, prev)->next_sibling = key;
+    else js_tok(p, t)->first_child = key;
+
+    if (type == JS_ARRAY) {
+      js_tok(p, key)->type = JS_ITEM;
+      js_tok(p, key)->idx = i;
+    } else if ((err = js_decode_key(p, key, decode))) {
+      return err;
+    }
+
+    js_tok(p, key)->parent = t;
+    js_tok(p, key)->first_child = val;
+    js_tok(p, val)->parent = key;
+
+    if ((err = decode(p, val))) return err;
+
+    prev = key;
+  }
+
+  buf_write(p->js, (type == JS_ARRAY) ? ']' : '}');
+  p->depth++;
+
+  js_tok(p, t)->start = start;
+  js_tok(p, t)->end = (p->js)->pos;
+  js_tok(p, t)->compact = 1;
+
+  return 0;
+}
+
+static jserr_t js_decode_msgpack(jsparser_t *p, size_t t) {
+  uint64_t u;
+  uint32_t f;
+  double d;
+  float x;
+  int c;
+
+  if (! js_bin_uint(p, 1, &u)) return JS_EDECODE;
+
+  if ((c = (int) u) <= 0x7f) return js_emit_int(p, t, 0, c);
+  if (c >= 0xe0) return js_emit_int(p, t, 1, 0x100 - c);
+  if (c <= 0x8f) return js_decode_members(p, t, JS_OBJECT, c & 0x0f, js_decode_msgpack);
+  if (c <= 0x9f) return js_decode_members(p, t, JS_ARRAY, c & 0x0f, js_decode_msgpack);
+  if (c <= 0xbf) return js_decode_string(p, t, c & 0x1f, 0);
+
+  switch (c) {
+    case 0xc0:
+      js_emit(p, t, JS_NULL, "null", 4);
+      return 0;
+    case 0xc2:
+    case 0xc3:
+      return js_emit_bool(p, t, c == 0xc3);
+    case 0xc4:
+    case 0xc5:
+    case 0xc6:
+      if (! js_bin_uint(p, 1 << (c - 0xc4), &u)) return JS_EDECODE;
+      return js_decode_string(p, t, u, 1);
+    case 0xca:
+      if (! js_bin_uint(p, 4, &u)) return JS_EDECODE;
+      f = (uint32_t) u;
+      memcpy(&x, &f, 4);
+      return js_emit_float(p, t, x, 1);
+    case 0xcb:
+      if (! js_bin_uint(p, 8, &u)) return JS_EDECODE;
+      memcpy(&d, &u, 8);
+      return js_emit_float(p, t, d, 0);
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+      if (! js_bin_uint(p, 1 << (c - 0xcc), &u)) return JS_EDECODE;
+      return js_emit_int(p, t, 0, u);
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+      // Sign extends the value, then negative values are written by magnitude.
+      if (! js_bin_uint(p, 1 << (c - 0xd0), &u)) return JS_EDECODE;
+      if (c < 0xd3 && (u >> ((8 << (c - 0xd0)) - 1))) u |= ~0ULL << (8 << (c - 0xd0));
+      return (u >> 63) ? js_emit_int(p, t, 1, ~u + 1) : js_emit_int(p, t, 0, u);
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+      if (! js_bin_uint(p, 1 << (c - 0xd9), &u)) return JS_EDECODE;
+      return js_decode_string(p, t, u, 0);
+    case 0xdc:
+    case 0xdd:
+      if (! js_bin_uint(p, 2 << (c - 0xdc), &u)) return JS_EDECODE;
+      return js_decode_members(p, t, JS_ARRAY, u, js_decode_msgpack);
+    case 0xde:
+    case 0xdf:
+      if (! js_bin_uint(p, 2 << (c - 0xde), &u)) return JS_EDECODE;
+      return js_decode_members(p, t, JS_OBJECT, u, js_decode_msgpack);
+    default:
+      // Extension types and the unused code 0xc1.
+      return JS_EDECODE;
+  }
+}
+
+// CBOR half precision floats are converted by hand.
+
+static double js_half(unsigned h) {
+  double x = (h & 0x7c00) == 0x7c00
+    ? ((h & 0x3ff) ? NAN : INFINITY)
+    : ldexp((h & 0x7c00) ? (h & 0x3ff) + 1024 : (h & 0x3ff),
+            ((h & 0x7c00) ? (int) ((h >> 10) & 0x1f) : 1) - 25);
+
+  return (h & 0x8000) ? -x : x;
+}
+
+// Reads the argument of a CBOR item: the low five bits of its first byte, or
+// the one to eight bytes that follow. Returns zero if it's missing or reserved.
+
+static int js_cbor_arg(jsparser_t *p, int info, uint64_t *u) {
+  if (info < 24) {
+    *u = info;
+    return 1;
+  }
+
+  return info <= 27 && js_bin_uint(p, 1 << (info - 24), u);
+}
+
+// Indefinite length strings are made of definite length chunks of the same
+// major type, up to a break code. Byte strings are base64 encoded as a whole,
+// so their chunks are collected first.
+
+static jserr_t js_decode_chunks(jsparser_t *p, size_t t, int major) {
+  Buffer *bytes = NULL;
+  jserr_t err = 0;
+  uint64_t u;
+  int c;
+
+  js_open_string(p, t);
+
+  if (major == 2) buf_alloc(&bytes);
+
+  while (!err) {
+    if (! js_bin_uint(p, 1, &u)) err = JS_EDECODE;
+    else if ((c = (int) u) == 0xff) break;
+    else if (c >> 5 != major || !js_cbor_arg(p, c & 0x1f, &u)) err = JS_EDECODE;
+    else if (! bytes) err = js_write_string(p, u);
+    else if (! js_bin_need(p, u)) err = JS_EDECODE;
+    else {
+      buf_append(bytes, (const char *) js_bin(p), u);
+      p->binpos += u;
+    }
+  }
+
+  if (bytes) {
+    if (!err) js_write_base64(p->js, (const unsigned char *) bytes->buf, bytes->pos);
+    buf_free(&bytes);
+  }
+
+  js_close_string(p, t);
+
+  return err;
+}
+
+static jserr_t js_decode_cbor(jsparser_t *p, size_t t) {
+  uint64_t u;
+  uint32_t f;
+  double d;
+  float x;
+  int c, major, info;
+
+  do {
+    if (! js_bin_uint(p, 1, &u)) return JS_EDECODE;
+    major = (c = (int) u) >> 5;
+    info = c & 0x1f;
+
+    if (info == 31) {
+      switch (major) {
+        case 2:
+        case 3:
+          return js_decode_chunks(p, t, major);
+        case 4:
+          return js_decode_members(p, t, JS_ARRAY, JS_INDEFINITE, js_decode_cbor);
+        case 5:
+          return js_decode_members(p, t, JS_OBJECT, JS_INDEFINITE, js_decode_cbor);
+        default:
+          return JS_EDECODE;
+      }
+    }
+
+    if (! js_cbor_arg(p, info, &u)) return JS_EDECODE;
+
+    // Tags are skipped: the tagged item is decoded on its own.
+  } while (major == 6);
+
+  switch (major) {
+    case 0:
+      return js_emit_int(p, t, 0, u);
+    case 1:
+      // -1 - u, whose magnitude can be one more than the largest uint64_t.
+      if (u == UINT64_MAX) return js_emit_float(p, t, -18446744073709551616.0, 0);
+      return js_emit_int(p, t, 1, u + 1);
+    case 2:
+    case 3:
+      return js_decode_string(p, t, u, major == 2);
+    case 4:
+      return js_decode_members(p, t, JS_ARRAY, u, js_decode_cbor);
+    case 5:
+      return js_decode_members(p, t, JS_OBJECT, u, js_decode_cbor);
+  }
+
+  switch (info) {
+    case 20:
+    case 21:
+      return js_emit_bool(p, t, info == 21);
+    case 22:
+    case 23:
+      js_emit(p, t, JS_NULL, "null", 4);
+      return 0;
+    case 25:
+      return js_emit_float(p, t, js_half((unsigned) u), 1);
+    case 26:
+      f = (uint32_t) u;
+      memcpy(&x, &f, 4);
+      return js_emit_float(p, t, x, 1);
+    case 27:
+      memcpy(&d, &u, 8);
+      return js_emit_float(p, t, d, 0);
+    default:
+      // Other simple values.
+      return JS_EDECODE;
+  }
+}
+
+// The format of the input is detected from its first bytes when the first
+// form is parsed. JSON text always starts with an ASCII character, or with a
+// UTF-8 byte order mark (which the JSON parser then rejects). CBOR is only
+// recognized by the self-described CBOR tag (0xd9d9f7), and MessagePack by an
+// array16/32 or map16/32 (0xdc-0xdf), which CBOR doesn't start with. Any other
+// binary input could be either (a CBOR array starts the same way as a
+// MessagePack map or array, for example), so JS_AUTO is returned and the
+// format has to be given.
+
+static jsformat_t js_detect(jsparser_t *p) {
+  const unsigned char *s;
+  size_t len;
+  unsigned char c;
+
+  if (p->map) {
+    s = (const unsigned char *) p->map;
+    len = p->maplen;
+  } else {
+    js_ensure_buf(p, 3);
+    s = (const unsigned char *) js(p);
+    len = (p->js)->pos - p->pos;
+  }
+
+  c = len ? s[0] : 0;
+
+  if (c < 0x80) return JS_JSON;
+  if (len >= 3 && !memcmp(s, "\xef\xbb\xbf", 3)) return JS_JSON;
+  if (len >= 3 && !memcmp(s, "\xd9\xd9\xf7", 3)) return JS_CBOR;
+
+  return (c >= 0xdc && c <= 0xdf) ? JS_MSGPACK : JS_AUTO;
+}
+
+static jserr_t js_decode_one(jsparser_t *p, size_t *t) {
+  jserr_t err;
+
+  // Input that's already been read into the input buffer is moved over.
+  if (! p->map && ! p->raw) {
+    buf_alloc(&(p->raw));
+    buf_append(p->raw, js(p), (p->js)->pos - p->pos);
+    buf_reset(p->js, 0);
+    p->binoff = p->offset + p->pos;
+    p->pos = 0;
+  }
+
+  // Input that was decoded is dropped once it's at least half the buffer.
+  if (p->raw && p->binpos && p->binpos >= (p->raw)->pos / 2) {
+    p->binoff += p->binpos;
+    buf_reset(p->raw, p->binpos);
+    p->binpos = 0;
+  }
+
+  if (! js_bin_need(p, 1)) return JS_EDONE;
+
+  p->mark = (p->js)->pos;
+  err = (p->format == JS_CBOR)
+    ? js_decode_cbor(p, (*t = js_next_tok(p)))
+    : js_decode_msgpack(p, (*t = js_next_tok(p)));
+  p->pos = (p->js)->pos;
+
+  return err;
+}
+
+/*
+ * parallel parser
+ *****************************************************************************/
+
+// A large collection can be parsed by several threads. One pass over the input
+// finds the offset of each of the collection's members (its structural
+// boundaries). The members are then split into ranges of about the same size
+// in bytes and each range is parsed by a worker thread into its own token
+// segment. Finally, the segments are appended to the parser's tokens and
+// linked into the collection.
+
+typedef struct {
+  jsparser_t p;
+  pthread_t thread;
+  jstype_t type;
+  char end;
+  size_t *starts;
+  size_t first;
+  size_t last;
+  size_t count;
+  size_t tail;
+  jserr_t err;
+} jsworker_t;
+
+static int js_scan_more(jsparser_t *p, size_t i) {
+  while (i >= (p->js)->pos)
+    if (! js_read(p)) return 0;
+  return 1;
+}
+
+// Returns the offset just past the end of the collection at p->pos, or 0 if
+// the input ends first. The structure of the collection is not validated, only
+// the member offsets are found -- the workers do the validation.
+
+static size_t js_scan_members(jsparser_t *p, size_t **starts, size_t *n) {
+  size_t i = p->pos + 1, depth = 1, size = 1024;
+  int member = 1;
+  char c;
+
+  *starts = jmalloc(sizeof(size_t) * size);
+  *n = 0;
+
+  for (; js_scan_more(p, i); i++) {
+    if (is_ws_char((c = (p->js)->buf[i]))) continue;
+
+    if (member) {
+      member = 0;
+      if (c != ']' && c != '}') {
+        if (*n >= size) *starts = jrealloc(*starts, sizeof(size_t) * (size *= 2));
+        (*starts)[(*n)++] = i;
+      }
+    }
+
+    switch (c) {
+      case '\"':
+        for (i++; js_scan_more(p, i) && (c = (p->js)->buf[i]) != '\"'; i++)
+          if (c == '\\') i++;
+        if (i >= (p->js)->pos) return 0;
+        break;
+      case '[':
+      case '{':
+        depth++;
+        break;
+      case ']':
+      case '}':
+        if (! --depth) return i + 1;
+        break;
+      case ',':
+        if (depth == 1) member = 1;
+        break;
+    }
+  }
+
+  return 0;
+}
+
+static void *js_parse_worker(void *arg) {
+  jsworker_t *w = arg;
+  jsparser_t *p = &(w->p);
+  size_t i;
+
+  for (i = w->first; i < w->last; i++) {
+    p->pos = w->starts[i];
+    if ((w->err = js_parse_member(p, 0, w->type, w->tail, &(w->tail)))) break;
+    js_skip_ws(p);
+    if (js(p)[0] != (i + 1 < w->count ? ',' : w->end)) {
+      w->err = JS_EPARSE;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void js_link_segment(jsparser_t *p, size_t t, jsworker_t *w, size_t *tail) {
+  size_t i, off = p->curtok, n = (w->p).curtok;
+  jstok_t *tok;
+
+  if (! w->tail) return;
+
+  while (off + n + 1 >= p->toks_size)
+    p->toks = jrealloc(p->toks, sizeof(jstok_t) * (p->toks_size *= 2));
+
+  memcpy(p->toks + off + 1, (w->p).toks + 1, sizeof(jstok_t) * n);
+
+  for (i = off + 1; i <= off + n; i++) {
+    tok = p->toks + i;
+    if (tok->first_child) tok->first_child += off;
+    if (tok->next_sibling) tok->next_sibling += off;
+    if (tok->parent) {
+      tok->parent += off;
+    } else {
+      tok->parent = t;
+      if (js_is_item(tok)) tok->idx += w->first;
+    }
+  }
+
+  if (*tail) js_tok(p, *tail)->next_sibling = off + 1;
+  else js_tok(p, t)->first_child = off + 1;
+
+  *tail = off + w->tail;
+  p->curtok += n;
+}
+
+static jserr_t js_parse_next(jsparser_t *p, size_t *t, int nthreads) {
+  size_t *starts, n, end, i, k, tail = 0, total;
+  jsworker_t *w;
+  jserr_t err = 0;
+  char c;
+
+  if (p->format == JS_AUTO && (p->format = js_detect(p)) == JS_AUTO)
+    return JS_EFORMAT;
+  if (p->format != JS_JSON) return js_decode_one(p, t);
+
+  if (p->sample > 1 && (err = js_sample(p))) return err;
+
+  js_skip_ws(p);
+
+  p->mark = p->pos;
+  c = js(p)[0];
+
+  if (p->scan && !p->cache && (c == '[' || c == '{'))
+    return js_scan_one(p, t);
+
+  if (nthreads < 2 || (c != '[' && c != '{'))
+    return js_parse_one(p, t);
+
+  if (! (end = js_scan_members(p, &starts, &n))) {
+    free(starts);
+    return p->more ? JS_EMORE : JS_EPARSE;
+  }
+
+  if (n < (size_t) nthreads * 2 || p->depth < 2) {
+    free(starts);
+    return js_parse_one(p, t);
+  }
+
+  *t = js_next_tok(p);
+
+  js_tok(p, *t)->type = (c == '[') ? JS_ARRAY : JS_OBJECT;
+  w = jmalloc(sizeof(jsworker_t) * nthreads);
+  total = end - starts[0];
+
+  for (i = 0, k = 0; k < (size_t) nthreads; k++) {
+    w[k].p = *p;
+    w[k].p.in = NULL;
+    w[k].p.toks_size = 1024;
+    w[k].p.toks = jmalloc(sizeof(jstok_t) * w[k].p.toks_size);
+    w[k].p.curtok = 0;
+    w[k].p.depth = p->depth - 1;
+    w[k].type = js_tok(p, *t)->type;
+    w[k].end = (c == '[') ? ']' : '}';
+    w[k].starts = starts;
+    w[k].count = n;
+    w[k].tail = 0;
+    w[k].err = 0;
+    w[k].first = i;
+    while (i < n && (k + 1 == (size_t) nthreads
+                     || starts[i] - starts[0] < total / nthreads * (k + 1)))
+      i++;
+    w[k].last = i;
+
+    if (pthread_create(&(w[k].thread), NULL, js_parse_worker, w + k))
+      die_err("can't create thread");
+  }
+
+  for (k = 0; k < (size_t) nthreads; k++) {
+    pthread_join(w[k].thread, NULL);
+    if (w[k].err && !err) {
+      err = w[k].err;
+      p->pos = w[k].p.pos;
+    }
+  }
+
+  for (k = 0; k < (size_t) nthreads; k++) {
+    if (!err) js_link_segment(p, *t, w + k, &tail);
+    free(w[k].p.toks);
+  }
+
+  free(w);
+  free(starts);
+
+  if (!err) {
+    js_tok(p, *t)->start = p->pos;
+    js_tok(p, *t)->end = p->pos = end;
+  }
+
+  return err;
+}
+
+/*
+ * parse cache
+ *****************************************************************************/
+
+// With a cache (see cache.c) each form is saved to it after it's parsed, or,
+// when the cache is valid, loaded from it instead of being parsed: the form's
+// input is copied to the input buffer and its tokens are unpacked, just as if
+// they had been parsed. Forms are always parsed completely when saved.
+
+static void js_save(jsparser_t *p, size_t t) {
+  size_t i, base = t - 1, start = p->mark, len = p->pos - p->mark;
+  CacheTok ct;
+  jstok_t *tok;
+
+  if (len >= UINT32_MAX || p->curtok - base >= UINT32_MAX) {
+    cache_fail(p->cache);
+    return;
+  }
+
+  cache_add(p->cache, (p->js)->buf + start, len, p->curtok - base);
+  memset(&ct, 0, sizeof(ct));
+
+  for (i = t; i <= p->curtok; i++) {
+    tok = js_tok(p, i);
+    ct.type = tok->type;
+    ct.compact = tok->compact;
+    ct.idx = tok->idx;
+    ct.start = (tok->start >= start) ? tok->start - start + 1 : 0;
+    ct.end = (tok->end >= start) ? tok->end - start + 1 : 0;
+    ct.parent = tok->parent ? tok->parent - base : 0;
+    ct.first_child = tok->first_child ? tok->first_child - base : 0;
+    ct.next_sibling = tok->next_sibling ? tok->next_sibling - base : 0;
+    cache_add_tok(p->cache, &ct);
+  }
+}
+
+static jserr_t js_load(jsparser_t *p, size_t *t) {
+  size_t i, n, len, base = p->curtok, start = (p->js)->pos;
+  const CacheTok *ct;
+  const char *s;
+  jstok_t *tok;
+
+  if (! cache_next(p->cache, &s, &len, &ct, &n)) return JS_EDONE;
+
+  while (base + n + 1 >= p->toks_size)
+    p->toks = jrealloc(p->toks, sizeof(jstok_t) * (p->toks_size *= 2));
+
+  buf_append(p->js, s, len);
+  p->mark = start;
+  p->pos = start + len;
+
+  for (i = 0; i < n; i++, ct++) {
+    tok = p->toks + base + 1 + i;
+    init_tok(tok);
+    tok->type = ct->type;
+    tok->compact = ct->compact;
+    tok->idx = ct->idx;
+    tok->start = ct->start ? start + ct->start - 1 : 0;
+    tok->end = ct->end ? start + ct->end - 1 : 0;
+    tok->parent = ct->parent ? base + ct->parent : 0;
+    tok->first_child = ct->first_child ? base + ct->first_child : 0;
+    tok->next_sibling = ct->next_sibling ? base + ct->next_sibling : 0;
+  }
+
+  p->curtok = base + n;
+  *t = base + 1;
+
+  return 0;
+}
+
+// Parses the next form, or loads it from the cache, if there is one.
+
+jserr_t js_parse_one_parallel(jsparser_t *p, size_t *t, int nthreads) {
+  jserr_t err;
+
+  if (p->cache && (p->cache)->map) return js_load(p, t);
+
+  err = js_parse_next(p, t, nthreads);
+  if (p->cache && !err) js_save(p, *t);
+
+  return err;
+}
+
+/*
+ * key-only skimming scanner
+ *****************************************************************************/
+
+// The skimmer walks the JSON input without building tokens, validating escape
+// sequences, or unescaping strings. The visitor is called for each value with
+// its nesting depth, its type, and the key of the pair it belongs to (NULL for
+// array items and top-level values). The key points into the input buffer and
+// is only valid until the visitor returns. Keys are passed around as offsets
+// because the buffer may be reallocated while reading more input.
+
+static jserr_t js_skim_string(jsparser_t *p) {
+  const char *s, *end;
+
+  for (p->pos++; ; ) {
+    s = js(p);
+    end = (p->js)->buf + (p->js)->pos;
+    while (s < end && *s != '\"' && *s != '\\') s++;
+    p->pos = s - (p->js)->buf;
+
+    if (s == end) {
+      js_ensure_buf(p, BUFSIZ);
+      if (p->pos == (p->js)->pos) return JS_EPARSE;
+    } else if (*s == '\\') {
+      js_ensure_buf(p, 2);
+      if (js(p)[1] == '\0') return JS_EPARSE;
+      p->pos += 2;
+    } else {
+      p->pos++;
+      return 0;
+    }
+  }
+}
+
+static jserr_t js_skim_primitive(jsparser_t *p) {
+  while (1) {
+    js_ensure_buf(p, 1);
+    switch (js(p)[0]) {
+      case ',': case ']': case '}': case ' ': case '\t': case '\r': case '\n':
+      case '\0':
+        return 0;
+    }
+    p->pos++;
+  }
+}
+
+static jserr_t js_skim(jsparser_t *p, size_t depth, size_t key, size_t len,
+                       jsvisit_t visit, void *ctx) {
+  jstype_t type;
+  size_t start, klen;
+  jserr_t err;
+  char end;
+
+  js_skip_ws(p);
+
+  switch (js(p)[0]) {
+    case '{': type = JS_OBJECT; break;
+    case '[': type = JS_ARRAY;  break;
+    case '\"': type = JS_STRING; break;
+    case 'n': type = JS_NULL;   break;
+    case 't': type = JS_TRUE;   break;
+    case 'f': type = JS_FALSE;  break;
+    default:
+      if (js(p)[0] != '-' && !is_digit_char(js(p)[0])) return JS_EPARSE;
+      type = JS_NUMBER;
+  }
+
+  visit(ctx, depth, key == SIZE_MAX ? NULL : (p->js)->buf + key, len, type);
+
+  switch (type) {
+    case JS_STRING:
+      return js_skim_string(p);
+    case JS_OBJECT:
+    case JS_ARRAY:
+      if (depth + 1 >= MAX_DEPTH) return JS_EPARSE;
+      break;
+    default:
+      return js_skim_primitive(p);
+  }
+
+  end = (type == JS_ARRAY) ? ']' : '}';
+  p->pos++;
+  js_skip_ws(p);
+
+  if (js(p)[0] == end) {
+    p->pos++;
+    return 0;
+  }
+
+  while (1) {
+    if (type == JS_OBJECT) {
+      js_skip_ws(p);
+      if (js(p)[0] != '\"') return JS_EPARSE;
+      start = p->pos + 1;
+      if ((err = js_skim_string(p))) return err;
+      klen = p->pos - start - 1;
+      js_skip_ws(p);
+      if (js(p)[0] != ':') return JS_EPARSE;
+      p->pos++;
+      if ((err = js_skim(p, depth + 1, start, klen, visit, ctx))) return err;
+    } else if ((err = js_skim(p, depth + 1, SIZE_MAX, 0, visit, ctx))) {
+      return err;
+    }
+
+    js_skip_ws(p);
+
+    if (js(p)[0] == end) {
+      p->pos++;
+      return 0;
+    } else if (js(p)[0] != ',') {
+      return JS_EPARSE;
+    }
+
+    p->pos++;
+  }
+}
+
+jserr_t js_skim_one(jsparser_t *p, jsvisit_t visit, void *ctx) {
+  js_skip_ws(p);
+  p->mark = p->pos;
+  return (js(p)[0] == '\0') ? JS_EDONE : js_skim(p, 0, SIZE_MAX, 0, visit, ctx);
+}
+
+/*
+ * create JSON primitives
+ *****************************************************************************/
+
+size_t js_create_index(jsparser_t *p, size_t idx) {
+  size_t item = js_next_tok(p);
+  js_tok(p, item)->type = JS_ITEM;
+  js_tok(p, item)->idx  = idx;
+  return item;
+}
+
+/*
+ * accessors
+ *****************************************************************************/
+
+size_t js_obj_get(jsparser_t *p, size_t obj, const char *key) {
+  size_t v, len = strlen(key);
+  jstok_t *tmp;
+  for(v = js_tok(p, obj)->first_child; v; v = js_tok(p, v)->next_sibling) {
+    tmp = js_tok(p, v);
+    if (tmp->end - tmp->start == len && !memcmp(key, (p->js)->buf + tmp->start, len))
+      return js_tok(p, v)->first_child;
+  }
+  return 0;
+}
+
+size_t js_array_get(jsparser_t *p, size_t ary, size_t idx) {
+  size_t i, v;
+  if (idx == SIZE_MAX) return 0;
+  v = js_tok(p, ary)->first_child;
+  for (i = 0; i < idx && v; i++)
+    v = js_tok(p, v)->next_sibling;
+  return (i == idx && v) ? js_tok(p, v)->first_child : 0;
+}
+
+/*
+ * JSON printer
+ *****************************************************************************/
+
+// Copies a span of JSON input, dropping whitespace outside of strings. Each
+// string and each run of other characters is copied in one piece, strings with
+// their quotes doubled for CSV output.
+
+#define JS_MINIFY(NAME, APPEND_STRING)                                        \
+static void NAME(Buffer *b, const char *s, size_t len) {                      \
+  const char *end = s + len, *q, *e;                                          \
+                                                                              \
+  while (s < end) {                                                           \
+    if (*s == '\"') {                                                         \
+      for (q = s + 1; (q = memchr(q, '\"', end - q)); q++) {                  \
+        for (e = q; *(e - 1) == '\\'; e--);                                   \
+        if (!((q - e) & 1)) break;                                            \
+      }                                                                       \
+      q = q ? q + 1 : end;                                                    \
+      APPEND_STRING(b, s, q - s);                                             \
+      s = q;                                                                  \
+    } else if (is_ws_char(*s)) {                                              \
+      s++;                                                                    \
+    } else {                                                                  \
+      for (q = s; q < end && *q != '\"' && !is_ws_char(*q); q++);             \
+      buf_append(b, s, q - s);                                                \
+      s = q;                                                                  \
+    }                                                                         \
+  }                                                                           \
+}
+
+JS_MINIFY(js_minify_tsv, buf_append)
+JS_MINIFY(js_minify_csv, buf_append_csv)
+
+// Canonical numbers are printed with the fewest significant digits that
+// convert back to the same double, so 1, 1.0 and 1e0 all print as 1. Numbers
+// too large for a double are printed as they are.
+
+static void js_print_number(jsparser_t *p, size_t t, Buffer *b) {
+  double x = js_num(p, t);
+  char tmp[32];
+
+  if (!isfinite(x)) {
+    buf_append(b, js_buf(p, t), js_len(p, t));
+    return;
+  }
+
+  buf_append(b, tmp, js_format_number(tmp, sizeof(tmp), x, 0));
+}
+
+// Collections can't be copied from the input when their numbers are printed
+// in canonical form, so they're printed member by member instead.
+
+static void js_print_members(jsparser_t *p, size_t t, Buffer *b, int csv) {
+  jstok_t *tok = js_tok(p, t);
+  size_t v;
+
+  buf_write(b, tok->type == JS_ARRAY ? '[' : '{');
+
+  for (v = tok->first_child; v; v = js_tok(p, v)->next_sibling) {
+    if (v != tok->first_child) buf_write(b, ',');
+    js_print(p, v, b, 1, csv);
+  }
+
+  buf_write(b, tok->type == JS_ARRAY ? ']' : '}');
+}
+
+jserr_t js_print(jsparser_t *p, size_t t, Buffer *b, int json, int csv) {
+  jstok_t *tok = js_tok(p, t);
+  char digitbuf[10];
+
+  switch (tok->type) {
+    case JS_ARRAY:
+    case JS_OBJECT:
+      if (p->canonical)
+        js_print_members(p, t, b, csv);
+      else if (!tok->compact && csv)
+        js_minify_csv(b, js_buf(p, t), js_len(p, t));
+      else if (!tok->compact)
+        js_minify_tsv(b, js_buf(p, t), js_len(p, t));
+      else if (csv)
+        buf_append_csv(b, js_buf(p, t), js_len(p, t));
+      else
+        buf_append(b, js_buf(p, t), js_len(p, t));
+      break;
+    case JS_PAIR:
+      if (!json) {
+        if (csv) {
+          js_unescape_string(b, js_buf(p, t), js_len(p, t), csv);
+        } else {
+          buf_append(b, js_buf(p, t), js_len(p, t));
+        }
+      } else {
+        buf_write(b, '\"');
+        if (csv) {
+          buf_write(b, '\"');
+          buf_append_csv(b, js_buf(p, t), js_len(p, t));
+          buf_write(b, '\"');
+        } else {
+          buf_append(b, js_buf(p, t), js_len(p, t));
+        }
+        buf_write(b, '\"');
+        buf_write(b, ':');
+        js_print(p, tok->first_child, b, json, csv);
+      }
+      break;
+    case JS_ITEM:
+      if (!json) {
+        snprintf(digitbuf, 10, "%zu", tok->idx);
+        buf_append(b, digitbuf, strlen(digitbuf));
+      } else {
+        js_print(p, tok->first_child, b, json, csv);
+      }
+      break;
+    case JS_STRING:
+      if (json) {
+        buf_write(b, '\"');
+        if (csv) buf_write(b, '\"');
+      }
+      if (csv) {
+        if (json) {
+          buf_append_csv(b, js_buf(p, t), js_len(p, t));
+        } else {
+          js_unescape_string(b, js_buf(p, t), js_len(p, t), csv);
+        }
+      } else {
+        buf_append(b, (p->js)->buf + tok->start, tok->end - tok->start);
+      }
+      if (json) {
+        buf_write(b, '\"');
+        if (csv) buf_write(b, '\"');
+      }
+      break;
+    case JS_NUMBER:
+      if (p->canonical) {
+        js_print_number(p, t, b);
+        break;
+      }
+      // fall through
+    case JS_NULL:
+    case JS_TRUE:
+    case JS_FALSE:
+      buf_append(b, (p->js)->buf + tok->start, tok->end - tok->start);
+      break;
+    default:
+      return JS_EBUG;
+  }
+
+  return 0;
+}
+
+jserr_t js_print_info(jsparser_t *p, size_t t, Buffer *b) {
+  jstok_t *tmp;
+  size_t v;
+
+  switch (js_tok(p, t)->type) {
+    case JS_OBJECT:
+      v = js_tok(p, t)->first_child;
+      while (v) {
+        tmp = js_tok(p, v);
+        buf_append(b, (p->js)->buf + tmp->start, tmp->end - tmp->start);
+        if ((v = js_tok(p, v)->next_sibling)) buf_write(b, '\n');
+      }
+      break;
+    case JS_ARRAY:
+      buf_append(b, "[array]", strlen("[array]"));
+      break;
+    case JS_STRING:
+      buf_append(b, "[string]", strlen("[string]"));
+      break;
+    case JS_NUMBER:
+      buf_append(b, "[number]", strlen("[number]"));
+      break;
+    case JS_TRUE:
+    case JS_FALSE:
+      buf_append(b, "[boolean]", strlen("[boolean]"));
+      break;
+    case JS_NULL:
+      buf_append(b, "[null]", strlen("[null]"));
+      break;
+    case JS_NONE:
+      buf_append(b, "[none]", strlen("[none]"));
+      break;
+    default:
+      return JS_EBUG;
+  }
+
+  return 0;
+}
+
+/*
+ * json string unescaping
+ *****************************************************************************/
+
+// The hex digits are read by hand: sscanf() would find the length of the
+// whole rest of the input buffer each time.
+
+static unsigned long js_read_u_escaped(char **s) {
+  unsigned long p = 0;
+  int i;
+  if (**s == '\\') *s += 2; // skip the \u if necessary
+  for (i = 0; i < 4 && is_hex_char(**s); i++, (*s)++)
+    p = p * 16 + ((**s <= '9') ? **s - '0' : (**s | 0x20) - 'a' + 10);
+  return p;
+}
+
+static unsigned long js_read_code_point(char **s) {
+  unsigned long cp = js_read_u_escaped(s);
+  return (cp >= 0xd800 && cp <= 0xdfff) // utf-16 surrogate pair
+    ? (((cp - 0xd800) & 0x3ff) << 10 | ((js_read_u_escaped(s) - 0xdc00) & 0x3ff)) + 0x10000
+    : cp;
+}
+
+static unsigned long utf_tag[4] = { 0x00, 0xc0, 0xe0, 0xf0 };
+
+static void js_encode_u_escaped(Buffer *b, char **in, int csv) {
+  char buf[4];
+  unsigned long p = js_read_code_point(in);
+  int width = (p < 0x80) ? 1 : (p < 0x800) ? 2 : (p < 0x10000) ? 3 : 4;
+
+  switch (width) {
+    case 4: buf[3] = ((p | 0x80) & 0xbf); p >>= 6;
+    case 3: buf[2] = ((p | 0x80) & 0xbf); p >>= 6;
+    case 2: buf[1] = ((p | 0x80) & 0xbf); p >>= 6;
+    case 1: buf[0] =  (p | utf_tag[width - 1]);
+  }
+
+  if (csv && width == 1 && buf[0] == '\"') {
+    buf[1] = '\"';
+    width++;
+  }
+
+  buf_append_unchecked(b, buf, width);
+}
+
+// The unescaper is specialized for CSV and TSV output, so that the output mode
+// isn't tested inside the loop. Runs of characters that need no unescaping are
+// found eight bytes at a time, like plain string characters in the parser, and
+// copied in one piece.
+
+#define JS_UNESCAPE(NAME, CSV)                                                \
+static void NAME(Buffer *b, char *in, size_t len) {                           \
+  char *inp = in, *endp = in + len, *run;                                     \
+  uint64_t x;                                                                 \
+                                                                              \
+  buf_check(b, len);                                                          \
+                                                                              \
+  while (inp < endp) {                                                        \
+    for (run = inp; endp - inp >= 8; inp += 8) {                              \
+      memcpy(&x, inp, 8);                                                     \
+      if (HAS_LESS(x, 0x20) | HAS_BYTE(x, '\"') | HAS_BYTE(x, '\\')) break;   \
+    }                                                                         \
+    for (; inp < endp && *inp != '\\' && *inp != '\"'                         \
+           && !(0 <= *inp && *inp < 32); inp++);                              \
+    buf_append_unchecked(b, run, inp - run);                                  \
+                                                                              \
+    if (inp == endp) break;                                                   \
+    if (*inp != '\\') die("can't parse JSON");                                \
+                                                                              \
+    if (CSV && *(inp + 1) == '\"')                                            \
+      buf_write_unchecked(b, '\"');                                           \
+    switch(*(++inp)) {                                                        \
+      case 'b': buf_write_unchecked(b, '\b'); inp++; break;                   \
+      case 'f': buf_write_unchecked(b, '\f'); inp++; break;                   \
+      case 'n': buf_write_unchecked(b, '\n'); inp++; break;                   \
+      case 'r': buf_write_unchecked(b, '\r'); inp++; break;                   \
+      case 't': buf_write_unchecked(b, '\t'); inp++; break;                   \
+      case 'u': inp++; js_encode_u_escaped(b, &inp, CSV); break;              \
+      case '\"': case '\\': case '/':                                         \
+        buf_write_unchecked(b, *(inp++)); break;                              \
+      default: die("can't parse JSON");                                       \
+    }                                                                         \
+  }                                                                           \
+}
+
+JS_UNESCAPE(js_unescape_tsv, 0)
+JS_UNESCAPE(js_unescape_csv, 1)
+
+void js_unescape_string(Buffer *b, char *in, size_t len, int csv) {
+  if (csv) js_unescape_csv(b, in, len);
+  else js_unescape_tsv(b, in, len);
+}
+
+/*
+ * parser housekeeping
+ *****************************************************************************/
+
+void js_reset(jsparser_t *p) {
+  p->offset += p->pos;
+  p->curtok = 1;
   buf_reset(p->js, p->pos);
   p->pos = 0;
   p->depth = MAX_DEPTH;
 }
 
+// Returns the offset of the parser in the whole input, eg. where a parse
+// error was found.
+
+size_t js_offset(jsparser_t *p) {
+  if (p->format == JS_MSGPACK || p->format == JS_CBOR) return p->binoff + p->binpos;
+  return p->offset + p->pos;
+}
+
+// Recovers from a parse error by skipping the rest of the line the bad form
+// started on, so that parsing continues with the next line. Returns the offset
+// of the bad form in the input.
+
+size_t js_resync(jsparser_t *p) {
+  size_t off = p->offset + p->mark;
+
+  p->pos = p->mark;
+  js_skip_to_eol(p);
+  js_reset(p);
+
+  return off;
+}
+
+// The form that was just parsed can be handed over to another thread in an
+// arena: js_take() swaps the parser's input buffer and tokens for the arena's,
+// moving the input that follows the form to the new buffer, and resets the
+// parser. The other thread swaps the arena into its own parser with js_swap()
+// to evaluate the form, and swaps it back out afterwards, so the buffers and
+// tokens are recycled.
+
+void js_swap(jsparser_t *p, jsarena_t *a) {
+  jsarena_t tmp = *a;
+
+  a->js = p->js;
+  a->toks = p->toks;
+  a->toks_size = p->toks_size;
+  a->curtok = p->curtok;
+
+  p->js = tmp.js;
+  p->toks = tmp.toks;
+  p->toks_size = tmp.toks_size;
+  p->curtok = tmp.curtok;
+}
+
+void js_take(jsparser_t *p, jsarena_t *a) {
+  buf_reset(a->js, 0);
+  buf_append(a->js, js(p), (p->js)->pos - p->pos);
+
+  js_swap(p, a);
+
+  p->offset += p->pos;
+  p->pos = 0;
+  p->curtok = 1;
+  p->depth = MAX_DEPTH;
+}
+
+void js_arena_alloc(jsarena_t *a) {
+  buf_alloc(&(a->js));
+  a->toks_size = 128;
+  a->toks = jmalloc(sizeof(jstok_t) * a->toks_size);
+  a->curtok = 1;
+}
+
+void js_arena_free(jsarena_t *a) {
+  buf_free(&(a->js));
+  free(a->toks);
+}
+
+// The input stream's contents can be mapped into memory: the parser then
+// copies the input from there instead of reading the stream. The mapping must
+// outlive the parser.
+
+void js_map(jsparser_t *p, const char *s, size_t len) {
+  p->map = s;
+  p->maplen = len;
+}
+
+// A parser with no input stream is fed from memory: js_feed() appends bytes to
+// its input buffer and js_finish() marks the end of the input. Until then the
+// parser returns JS_EMORE when it runs out of complete JSON forms.
+
+void js_feed(jsparser_t *p, const char *s, size_t len) {
+  buf_append(p->js, s, len);
+}
+
+void js_finish(jsparser_t *p) {
+  p->more = 0;
+}
+
 void js_alloc(jsparser_t **p, FILE *in, size_t toks_size) {
   *p = jmalloc(sizeof(jsparser_t));
   buf_alloc(&((*p)->js));
+  (*p)->raw = NULL;
+  (*p)->binpos = 0;
+  (*p)->binoff = 0;
+  (*p)->format = JS_JSON;
   (*p)->pos = 0;
+  (*p)->offset = 0;
+  (*p)->mark = 0;
+  (*p)->ws = 0;
+  (*p)->utf8 = 1;
+  (*p)->canonical = 0;
+  (*p)->sample = 0;
+  (*p)->scan = NULL;
   (*p)->in = in;
+  (*p)->reader = NULL;
+  (*p)->cache = NULL;
+  (*p)->map = NULL;
+  (*p)->maplen = 0;
+  (*p)->more = !in;
+  (*p)->starved = 0;
+  (*p)->lines = 0;
+  (*p)->threads = 1;
+  (*p)->forms = 0;
   (*p)->toks = jmalloc(sizeof(jstok_t) * toks_size);
   (*p)->toks_size = toks_size;
   js_reset(*p);
 }
 
 void js_free(jsparser_t **p) {
+  if ((*p)->reader) reader_free(&((*p)->reader));
+  if ((*p)->cache) cache_free(&((*p)->cache));
+  if ((*p)->raw) buf_free(&((*p)->raw));
   buf_free(&((*p)->js));
   free((*p)->toks);
   free(*p);
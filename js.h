@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 #include "buffer.h"
+#include "cache.h"
+#include "reader.h"
 #include "util.h"
 
 typedef enum {
@@ -26,9 +28,20 @@ typedef enum {
   JS_OKAY,
   JS_EBUG,
   JS_EPARSE,
-  JS_EDONE
+  JS_EDONE,
+  JS_EMORE,
+  JS_EUTF8,
+  JS_EDECODE,
+  JS_EFORMAT
 } jserr_t;
 
+typedef enum {
+  JS_AUTO,
+  JS_JSON,
+  JS_MSGPACK,
+  JS_CBOR
+} jsformat_t;
+
 typedef struct {
   jstype_t type;
   size_t start;
@@ -38,21 +51,57 @@ typedef struct {
   size_t first_child;
   size_t next_sibling;
   size_t parsed;
+  double num;
+  int compact;
+  int numeric;
 } jstok_t;
 
 typedef struct {
   FILE *in;
+  Reader *reader;
+  Cache *cache;
+  const char *map;
+  size_t maplen;
   Buffer *js;
+  Buffer *raw;
+  size_t binpos;
+  size_t binoff;
+  jsformat_t format;
   size_t pos;
+  size_t offset;
+  size_t mark;
   jstok_t *toks;
   size_t curtok;
   size_t toks_size;
   size_t depth;
+  size_t forms;
+  size_t sample;
+  const char *scan;
+  size_t ws;
+  int threads;
+  int more;
+  int starved;
+  int lines;
+  int utf8;
+  int canonical;
 } jsparser_t;
 
+// A form that was parsed by one parser and is evaluated with another, see
+// js_take().
+
+typedef struct {
+  Buffer *js;
+  jstok_t *toks;
+  size_t toks_size;
+  size_t curtok;
+} jsarena_t;
+
+typedef void (*jsvisit_t)(void *ctx, size_t depth, const char *key, size_t len, jstype_t type);
+
 jstok_t *js_tok(jsparser_t *p, size_t t);
 char *js_buf(jsparser_t *p, size_t t);
 size_t js_len(jsparser_t *p, size_t t);
+double js_num(jsparser_t *p, size_t t);
 
 // predicates
 
@@ -70,7 +119,20 @@ void js_alloc(jsparser_t **p, FILE *in, size_t toks_size);
 void js_free(jsparser_t **p);
 jserr_t js_parse(jsparser_t *p, size_t t);
 jserr_t js_parse_one(jsparser_t *p, size_t *t);
+jserr_t js_parse_one_parallel(jsparser_t *p, size_t *t, int nthreads);
 void js_reset(jsparser_t *p);
+size_t js_offset(jsparser_t *p);
+size_t js_resync(jsparser_t *p);
+size_t js_skip_lines(jsparser_t *p, size_t n);
+int js_read_line(jsparser_t *p, Buffer *b);
+void js_take(jsparser_t *p, jsarena_t *a);
+void js_swap(jsparser_t *p, jsarena_t *a);
+void js_arena_alloc(jsarena_t *a);
+void js_arena_free(jsarena_t *a);
+void js_map(jsparser_t *p, const char *s, size_t len);
+void js_feed(jsparser_t *p, const char *s, size_t len);
+void js_finish(jsparser_t *p);
+jserr_t js_skim_one(jsparser_t *p, jsvisit_t visit, void *ctx);
 
 // accessors
 
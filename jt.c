@@ -2,13 +2,35 @@
  * jt: transform JSON into tabular data
  *****************************************************************************/
 
-#include "stack.h"
-#include "buffer.h"
-#include "js.h"
-#include "util.h"
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shard.h"
+#include "sketch.h"
+#include "sort.h"
+#include "table.h"
+#include "jt.h"
 
-#ifndef JT_STACKSIZE
-#define JT_STACKSIZE 256
+#ifndef JT_OUTBUFSIZE
+#define JT_OUTBUFSIZE (1 << 20)
+#endif
+
+#ifndef JT_SORTMEMORY
+#define JT_SORTMEMORY 256
+#endif
+
+#ifndef JT_MAXTHREADS
+#define JT_MAXTHREADS 256
+#endif
+
+#ifndef JT_MAXSHARDS
+#define JT_MAXSHARDS 4096
+#endif
+
+#ifndef JT_MAXBATCH
+#define JT_MAXBATCH 65536
 #endif
 
 #define JT_VERSION "4.3.3"
@@ -16,178 +38,973 @@
 int opt_join = 0;
 int opt_iter = 0;
 int opt_csv  = 0;
+int opt_keys = 0;
+int opt_threads = 1;
+int opt_trust   = 0;
+int opt_reader  = 0;
+int opt_sketch  = 0;
+int opt_tolerant = 0;
+int opt_canonical = 0;
+int opt_pipeline  = 0;
+int opt_lines = 0;
+const char *opt_follow = NULL;
+size_t opt_limit  = 0;
+size_t opt_sample = 0;
+size_t opt_reservoir = 0;
+int opt_jobs = 1;
+int opt_interleave = 0;
+int opt_filename  = 0;
+size_t opt_sort_memory = JT_SORTMEMORY;
+int opt_shards = 0;
+int opt_shard_key = 0;
+const char *opt_shard_files = "shard-%d";
+const char *opt_cache = NULL;
+int opt_stats = 0;
+jsformat_t opt_format = JS_AUTO;
+int opt_flatten = 0;
+size_t opt_batch = 0;
+
+int sort_keyc = 0;
+SortKey *sort_keyv = NULL;
+Sorter **sortv = NULL;
+Sharder **shardv = NULL;
+
+FILE *rejects_out = NULL;
+size_t rejects = 0;
+size_t forms = 0;
+const char *cache_result = NULL;
 
-FILE *devnull;
-Buffer *OUTBUF;
 jsparser_t *p;
+const char *input_name = NULL;
 
-Stack *DAT;
-Stack *OUT;
-Stack *SUB;
-Stack *ITR;
-Stack *IDX;
+int filec = 0;
+char **filev = NULL;
 
-typedef struct {
-  char cmd;
-  char *text;
-} word_t;
+int progc = 0;
+jt_t **progv = NULL;
+const char **destv = NULL;
+int *argcv = NULL;
+char ***argvv = NULL;
 
 /*
- * interpreter
+ * sketches
  *****************************************************************************/
 
-int run(int wordc, word_t *wordv) {
-  size_t d = stack_head(DAT), tmp, itr, root;
-  int e = 0, cols = 0;
+// In sketch mode (-S) each column of each program's output is summarized by
+// a sketch instead of being printed, see sketch.c.
 
-  if (wordc <= 0) return 0;
+typedef struct {
+  Sketch **cols;
+  int n;
+} sketches_t;
 
-  if ((e = (wordv[0].cmd == '.')) || (d && js_is_array(js_tok(p, d)) && !opt_iter)) {
-    if (!d) {
-      stack_push(DAT, 0);
-      if (opt_join) cols = -JT_STACKSIZE;
-    } else if (!js_is_collection(js_tok(p, d)) || js_is_empty(js_tok(p, d))) {
-      stack_push(DAT, 0);
-      run(wordc - e, wordv + e);
-      if (opt_join) cols = -JT_STACKSIZE;
-    } else {
-      if (stack_depth(ITR)) {
-        itr = (size_t) stack_head(ITR);
-        stack_pop(ITR);
-      } else {
-        itr = js_tok(p, d)->first_child;
-      }
+void sketch_row(void *ctx, jsparser_t *p, const size_t *toks, int n) {
+  sketches_t *s = ctx;
+  char digitbuf[32];
+  const char *val;
+  size_t len;
+  jstok_t *tok;
+  int i;
 
-      stack_push(IDX, itr);
-      stack_push(DAT, js_tok(p, itr)->first_child);
-      cols = run(wordc - e, wordv + e);
-      stack_pop(IDX);
+  for (; s->n < n; s->n++) {
+    s->cols = jrealloc(s->cols, sizeof(Sketch *) * (s->n + 1));
+    sketch_alloc(s->cols + s->n);
+  }
 
-      if (! stack_depth(ITR)) itr = js_tok(p, itr)->next_sibling;
+  for (i = 0; i < n; i++) {
+    if (!toks[i]) {
+      sketch_add(s->cols[i], "", 0, 0, 0);
+      continue;
+    }
 
-      if (itr) stack_push(ITR, itr);
+    tok = js_tok(p, toks[i]);
+    if (js_is_item(tok)) {
+      snprintf(digitbuf, sizeof(digitbuf), "%zu", tok->idx);
+      val = digitbuf;
+      len = strlen(digitbuf);
+    } else {
+      val = js_buf(p, toks[i]);
+      len = js_len(p, toks[i]);
     }
-    return cols;
-  } else {
-    switch (wordv[0].cmd) {
-      case '^':
-        cols = 1;
-        stack_push(OUT, stack_head(IDX));
-        break;
-      case '%':
-        cols = 1;
-        stack_push(OUT, d);
-        break;
-      case '+':
-        if (js_tok(p, d)->parsed) {
-          stack_push(DAT, js_tok(p, d)->parsed);
-        } else if (js_is_string(js_tok(p, d))) {
-          js_unescape_string(p->js, js_buf(p, d), js_len(p, d), 0);
-          if (! js_parse_one(p, &root)) {
-            js_tok(p, d)->parsed = root;
-            stack_push(DAT, root);
-          }
-        }
-        break;
-      case '[':
-        stack_push(SUB, stack_depth(DAT));
-        break;
-      case ']':
-        while (stack_depth(DAT) != stack_head(SUB))
-          stack_pop(DAT);
-        stack_pop(SUB);
-        break;
-      case '\0':
-        if (d && js_is_collection(js_tok(p, d))) {
-          tmp = js_is_object(js_tok(p, d))
-            ? js_obj_get(p, d, wordv[0].text)
-            : js_array_get(p, d, strtosizet(wordv[0].text));
-          if (! (tmp || !opt_join)) return -JT_STACKSIZE;
-          stack_push(DAT, tmp);
-        } else {
-          if (opt_join) return -JT_STACKSIZE;
-          stack_push(DAT, 0);
-        }
+
+    if (tok->type == JS_NUMBER) {
+      sketch_add(s->cols[i], val, len, 1, js_num(p, toks[i]));
+    } else {
+      sketch_add(s->cols[i], val, len, 0, 0);
+    }
+  }
+}
+
+// Columns are named by their headings (see the `%=` command), or numbered
+// from 1 when they have none.
+
+void print_sketches(jt_t *jt) {
+  sketches_t *s = jt->cols_ctx;
+  char digitbuf[16];
+  const char *name;
+  int i, w = 0;
+
+  for (i = 0; i < s->n; i++) {
+    for (name = NULL; w < jt->wordc; w++) {
+      if (jt->wordv[w].cmd == '%' || jt->wordv[w].cmd == '^') {
+        name = jt->wordv[w++].text;
         break;
-      case '@':
-        js_print_info(p, d, OUTBUF);
-        buf_println(OUTBUF);
-        exit(0);
-      default:
-        die("unexpected command");
+      }
     }
+    if (! name || ! *name) {
+      snprintf(digitbuf, sizeof(digitbuf), "%d", i + 1);
+      name = digitbuf;
+    }
+    sketch_print(s->cols[i], name, jt->ctx);
   }
 
-  return cols + run(wordc - 1, wordv + 1);
+#ifdef JT_VALGRIND
+  for (i = 0; i < s->n; i++)
+    sketch_free(s->cols + i);
+  free(s->cols);
+  free(s);
+#endif /* JT_VALGRIND */
 }
 
 /*
- * helpers
+ * sorting
  *****************************************************************************/
 
-size_t parse_as_string(const char *s) {
-  FILE *in = p->in;
-  size_t t;
+// With --sort each program's rows go to a sorter (see sort.c) and are written
+// when all of the input has been read. The keys are a comma separated list of
+// column numbers, counting from 1, each followed by `n` to compare the column
+// as numbers instead of text.
 
-  p->in = devnull;
+void parse_sort_keys(const char *spec) {
+  const char *s = spec;
+  char *end;
+  long col;
 
-  buf_write(p->js, '\"');
-  buf_append(p->js, s, strlen(s));
-  buf_write(p->js, '\"');
+  while (1) {
+    col = strtol(s, &end, 10);
+    if (end == s || col < 1 || col > JT_STACKSIZE) die("invalid sort keys: %s", spec);
 
-  if (js_parse_one(p, &t))
-    die("can't parse JSON");
+    sort_keyv = jrealloc(sort_keyv, sizeof(SortKey) * (sort_keyc + 1));
+    sort_keyv[sort_keyc].col = (int) col - 1;
+    if ((sort_keyv[sort_keyc].numeric = (*end == 'n'))) end++;
+    sort_keyc++;
 
-  p->in = in;
-  return t;
+    if (*end == '\0') break;
+    if (*end != ',') die("invalid sort keys: %s", spec);
+    s = end + 1;
+  }
 }
 
-void print_tok(size_t t) {
-  if (!t) return;
-  if (opt_csv) buf_write(OUTBUF, '\"');
-  js_print(p, t, OUTBUF, 0, opt_csv);
-  if (opt_csv) buf_write(OUTBUF, '\"');
+void sort_row(void *ctx, const char *row, size_t len) {
+  sorter_add(ctx, row, len);
 }
 
-void print_stack(Stack *s) {
-  for (int i = 0; i <= s->head; i++) {
-    print_tok((s->items)[i]);
-    if (i < s->head) buf_write(OUTBUF, opt_csv ? ',' : '\t');
+// The memory budget is split between the programs. The headings are taken
+// from the programs, so that the sorters can write them before the rows.
+
+void add_sorters() {
+  size_t budget = (opt_sort_memory << 20) / progc;
+
+  sortv = jmalloc(sizeof(Sorter *) * progc);
+
+  for (int i = 0; i < progc; i++) {
+    sorter_alloc(sortv + i, sort_keyv, sort_keyc, opt_csv, budget, progv[i]->ctx);
+    sortv[i]->limit = opt_limit;
+    sortv[i]->header = progv[i]->header;
+    progv[i]->header = NULL;
+    progv[i]->limit = 0;
+    progv[i]->row = sort_row;
+    progv[i]->ctx = sortv[i];
   }
 }
 
-int parse_commands(int argc, char *argv[], word_t *wordv) {
-  int i, len, e, have_headers = 0;
+void finish_sorters() {
+  for (int i = 0; i < progc; i++) {
+    sorter_finish(sortv[i]);
+#ifdef JT_VALGRIND
+    if (sortv[i]->header) buf_free(&(sortv[i]->header));
+    sorter_free(sortv + i);
+#endif /* JT_VALGRIND */
+  }
+}
+
+/*
+ * sharding
+ *****************************************************************************/
+
+// With --shards each program's rows are split between files by the hash of
+// one of their columns (see shard.c). The files are named after the program's
+// destination, or after the --shard-files pattern if it writes to stdout.
+
+void shard_row(void *ctx, const char *row, size_t len) {
+  sharder_add(ctx, row, len);
+}
+
+const char *shard_pattern(int i) {
+  return (destv[i] && strcmp(destv[i], "&1")) ? destv[i] : opt_shard_files;
+}
+
+void add_sharders() {
+  const char *pattern;
+
+  shardv = jmalloc(sizeof(Sharder *) * progc);
+
+  for (int i = 0; i < progc; i++) {
+    pattern = shard_pattern(i);
+
+    if (pattern[0] == '&') die("can't shard output to a file descriptor: %s", pattern);
+    for (int j = 0; j < i; j++)
+      if (!strcmp(shard_pattern(j), pattern)) die("programs can't share shards: %s", pattern);
+
+    sharder_alloc(shardv + i, pattern, opt_shards, opt_shard_key, opt_csv,
+                  opt_lines ? _IOLBF : _IOFBF);
+    shardv[i]->header = progv[i]->header;
+    progv[i]->header = NULL;
+    progv[i]->row = shard_row;
+    progv[i]->ctx = shardv[i];
+  }
+}
+
+void finish_sharders() {
+  for (int i = 0; i < progc; i++) {
+    if (shardv[i]->header) buf_free(&(shardv[i]->header));
+    sharder_free(shardv + i);
+  }
+}
+
+/*
+ * programs
+ *****************************************************************************/
+
+void write_row(void *ctx, const char *row, size_t len) {
+  fwrite(row, 1, len, (FILE *) ctx);
+  fputc('\n', (FILE *) ctx);
+}
+
+FILE *open_output(const char *dest) {
+  FILE *out;
+  int i;
+
+  for (i = 0; i < progc; i++)
+    if (destv[i] && !strcmp(destv[i], dest))
+      return (FILE *) progv[i]->ctx;
+
+  if (!strcmp(dest, "&1")) {
+    return stdout;
+  } else if (dest[0] == '&') {
+    if (! (out = fdopen((int) strtosizet(dest + 1), "w")))
+      die_err("can't open file descriptor: %s", dest + 1);
+  } else if (! (out = fopen(dest, "w"))) {
+    die_err("can't open output file: %s", dest);
+  }
+
+  setvbuf(out, NULL, opt_lines ? _IOLBF : _IOFBF, JT_OUTBUFSIZE);
+  return out;
+}
+
+int program_flags() {
+  return (opt_join ? JT_JOIN : 0) | (opt_iter ? JT_ITER : 0) | (opt_csv ? JT_CSV : 0)
+    | (opt_filename ? JT_SOURCE : 0) | (opt_flatten ? JT_FLATTEN : 0);
+}
+
+// The words of each program are kept, so that each thread working on input
+// files (--jobs) can make its own copy of the programs.
+
+void add_program(int argc, char *argv[], const char *dest) {
+  jterr_t err;
+  FILE *out;
+
+  if (argc <= 0 && !opt_flatten) die("empty program");
+
+  out = (dest && !opt_shards) ? open_output(dest) : stdout;
+
+  progv = jrealloc(progv, sizeof(jt_t *) * (progc + 1));
+  destv = jrealloc(destv, sizeof(char *) * (progc + 1));
+  argcv = jrealloc(argcv, sizeof(int) * (progc + 1));
+  argvv = jrealloc(argvv, sizeof(char **) * (progc + 1));
+
+  argcv[progc] = argc;
+  argvv[progc] = jmalloc(sizeof(char *) * argc);
+  memcpy(argvv[progc], argv, sizeof(char *) * argc);
+
+  if ((err = jt_alloc(progv + progc, argc, argv, program_flags(), write_row, out)))
+    die("%s", jt_error(err));
+  if (opt_sketch) {
+    progv[progc]->cols = sketch_row;
+    progv[progc]->cols_ctx = jmalloc(sizeof(sketches_t));
+    ((sketches_t *) progv[progc]->cols_ctx)->n = 0;
+    ((sketches_t *) progv[progc]->cols_ctx)->cols = NULL;
+  }
+
+  destv[progc++] = dest;
+}
+
+// Programs are separated by `>DEST` words, where DEST is the name of the
+// file the preceding program writes to, or `&N` for file descriptor N. The
+// last program writes to stdout unless it is followed by a `>DEST` word.
+
+void add_programs(int argc, char *argv[]) {
+  int i, start = 0;
+
   for (i = 0; i < argc; i++) {
-    len = strlen(argv[i]);
-    if (len == 1) {
-      switch(argv[i][0]) {
-        case '[': case ']': case '@': case '.': case '+':
-          wordv[i].cmd = argv[i][0];
-          wordv[i].text = NULL;
-          break;
-        case '%': case '^':
-          wordv[i].cmd = argv[i][0];
-          wordv[i].text = NULL;
-          stack_push(OUT, parse_as_string(""));
-          break;
-        default:
-          wordv[i].cmd = '\0';
-          wordv[i].text = argv[i];
+    if (argv[i][0] == '>' && argv[i][1] != '\0') {
+      add_program(i - start, argv + start, argv[i] + 1);
+      start = i + 1;
+    }
+  }
+
+  if (start < argc) add_program(argc - start, argv + start, NULL);
+}
+
+// Program files contain one program per line, words separated by whitespace.
+// Blank lines and lines starting with `#` are ignored.
+
+void load_programs(const char *file) {
+  FILE *in;
+  Buffer *b;
+  char *line, *next, **words = NULL;
+  int n, size = 0;
+
+  if (! (in = fopen(file, "r")))
+    die_err("can't open program file: %s", file);
+
+  buf_alloc(&b);
+  while (buf_append_read(b, in));
+  fclose(in);
+
+  for (line = b->buf; line; line = next) {
+    if ((next = strchr(line, '\n'))) *(next++) = '\0';
+
+    for (n = 0; (line = strtok(n ? NULL : line, " \t\r")); n++) {
+      if (!n && line[0] == '#') break;
+      if (n >= size) words = jrealloc(words, sizeof(char*) * (size += 16));
+      words[n] = line;
+    }
+
+    if (n && words[0][0] != '#') add_programs(n, words);
+  }
+
+  // Output file names point into the buffer, so it must not be freed.
+  free(words);
+}
+
+/*
+ * schema discovery
+ *****************************************************************************/
+
+// Every path seen in the input is recorded with the number of values found
+// there and the set of their types. Paths are written as jt words, so arrays
+// don't add to the path unless explicit iteration (-a) is enabled, in which
+// case the `.` command is used to get to the items.
+
+static const char *schema_type_names[] = {
+  "object", "array", "string", "number", "boolean", "null"
+};
+
+Table *schema_paths;
+Buffer *schema_path;
+size_t *schema_counts;
+unsigned *schema_types;
+size_t schema_size = 0;
+size_t schema_lens[JT_STACKSIZE];
+
+unsigned schema_type_bit(jstype_t type) {
+  switch (type) {
+    case JS_OBJECT: return 1 << 0;
+    case JS_ARRAY:  return 1 << 1;
+    case JS_STRING: return 1 << 2;
+    case JS_NUMBER: return 1 << 3;
+    case JS_TRUE:
+    case JS_FALSE:  return 1 << 4;
+    default:        return 1 << 5;
+  }
+}
+
+int is_command_word(const char *s, size_t len) {
+  return len == 0
+    || (len == 1 && strchr("[]@.+%^", s[0]))
+    || (len >= 2 && (s[0] == '%' || s[0] == '^') && s[1] == '=')
+    || (len >= 2 && s[0] == '[' && s[len - 1] == ']')
+    || (len >= 2 && s[0] == '>');
+}
+
+void schema_visit(void *ctx, size_t depth, const char *key, size_t len, jstype_t type) {
+  Buffer *path = schema_path;
+  size_t i, n = schema_paths->count;
+
+  path->pos = depth ? schema_lens[depth - 1] : 0;
+
+  if (key || (depth && opt_iter)) {
+    if (path->pos) buf_write(path, ' ');
+    if (!key) {
+      buf_write(path, '.');
+    } else if (is_command_word(key, len)) {
+      buf_write(path, '[');
+      buf_append(path, key, len);
+      buf_write(path, ']');
+    } else {
+      buf_append(path, key, len);
+    }
+  }
+
+  schema_lens[depth] = path->pos;
+
+  if (type == JS_ARRAY && !opt_iter) return;
+
+  i = table_put(schema_paths, path->buf, path->pos);
+
+  if (i >= schema_size) {
+    schema_size = schema_size ? schema_size * 2 : 64;
+    schema_counts = jrealloc(schema_counts, sizeof(size_t) * schema_size);
+    schema_types  = jrealloc(schema_types, sizeof(unsigned) * schema_size);
+  }
+
+  if (i == n) {
+    schema_counts[i] = 0;
+    schema_types[i] = 0;
+  }
+
+  schema_counts[i]++;
+  schema_types[i] |= schema_type_bit(type);
+}
+
+/*
+ * errors
+ *****************************************************************************/
+
+void input_error(const char *name, jserr_t err, size_t off) {
+  const char *what = (err == JS_EUTF8) ? "invalid UTF-8"
+    : (err == JS_EDECODE) ? "can't decode MessagePack or CBOR" : "can't parse JSON";
+
+  // Don't leave a half written cache behind.
+  if (p && p->cache) cache_free(&(p->cache));
+
+  if (err == JS_EFORMAT && name) die("%s: ambiguous binary input, use --format", name);
+  if (err == JS_EFORMAT) die("ambiguous binary input, use --format");
+
+  if (name) die("%s: %s at byte %zu", name, what, off);
+  die("%s at byte %zu", what, off);
+}
+
+void parse_error(jserr_t err) {
+  input_error(input_name, err, js_offset(p));
+}
+
+// In tolerant mode (-t) a bad form is skipped up to the end of its line and
+// its offset is written to the rejects file (-e), if there is one, after the
+// name of the input file and a tab when the input is read from files.
+
+void log_reject(const char *name, size_t off) {
+  rejects++;
+  if (rejects_out && name) fprintf(rejects_out, "%s\t%zu\n", name, off);
+  else if (rejects_out) fprintf(rejects_out, "%zu\n", off);
+}
+
+// Binary input can't be resynchronized after an error, so it's always fatal.
+
+void reject(jserr_t err) {
+  if (! opt_tolerant || p->format != JS_JSON) parse_error(err);
+  log_reject(input_name, js_resync(p));
+}
+
+/*
+ * input
+ *****************************************************************************/
+
+// Input files are named after a `--` word, otherwise the input is read from
+// stdin. A regular file is mapped into memory and the parser copies its input
+// from there, saving a read() call and a copy for every block.
+
+typedef struct {
+  const char *name;
+  FILE *in;
+  char *map;
+  size_t size;
+  jsparser_t *p;
+} input_t;
+
+// The input format (--format) is detected from the first bytes of each input
+// unless it's given, see js_detect().
+
+jsformat_t parse_format(const char *name) {
+  if (!strcmp(name, "auto"))    return JS_AUTO;
+  if (!strcmp(name, "json"))    return JS_JSON;
+  if (!strcmp(name, "msgpack")) return JS_MSGPACK;
+  if (!strcmp(name, "cbor"))    return JS_CBOR;
+  die("invalid format: %s", name);
+  return JS_AUTO;
+}
+
+void setup_parser(jsparser_t *p) {
+  p->threads = opt_threads;
+  p->utf8 = !opt_trust;
+  p->canonical = opt_canonical;
+  p->sample = opt_sample;
+  p->lines = opt_lines;
+  p->format = opt_format;
+}
+
+// With --cache the parser saves the forms it parses to the cache file, or
+// loads them from there if the cache is valid for the input (see cache.c).
+// Returns whether it was.
+
+int open_cache(jsparser_t *p, FILE *in) {
+  cache_alloc(&(p->cache), opt_cache, in);
+
+  if (! (p->cache)->map) return 0;
+
+  p->in = NULL;
+  p->more = 0;
+  return 1;
+}
+
+void open_input(input_t *in, const char *name) {
+  struct stat st;
+
+  in->name = name;
+  in->map = NULL;
+
+  if (! (in->in = fopen(name, "r")))
+    die_err("can't open input file: %s", name);
+
+  js_alloc(&(in->p), in->in, 128);
+  setup_parser(in->p);
+
+  if (opt_cache && open_cache(in->p, in->in)) return;
+
+  if (!fstat(fileno(in->in), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    in->size = st.st_size;
+    in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fileno(in->in), 0);
+    if (in->map == MAP_FAILED) in->map = NULL;
+  }
+
+  if (in->map) {
+    madvise(in->map, in->size, MADV_SEQUENTIAL);
+    js_map(in->p, in->map, in->size);
+  } else if (opt_reader) {
+    reader_alloc(&(in->p->reader), in->in, NULL);
+  }
+}
+
+void close_input(input_t *in) {
+  js_free(&(in->p));
+  if (in->map) munmap(in->map, in->size);
+  fclose(in->in);
+}
+
+jserr_t exec(jt_t **jtv, int jtc, jsparser_t *p) {
+  if (opt_batch > 1) return jt_exec_batched(jtv, jtc, p, opt_batch);
+  return opt_pipeline ? jt_exec_pipelined(jtv, jtc, p) : jt_exec(jtv, jtc, p);
+}
+
+int halted() {
+  for (int i = 0; i < progc; i++)
+    if (! progv[i]->halt) return 0;
+  return progc > 0;
+}
+
+// The cache is only kept if all of the input was parsed without errors.
+
+void close_cache(jsparser_t *p) {
+  if (! p->cache) return;
+
+  if ((p->cache)->map) cache_result = "hit";
+  else if (!rejects && !halted() && cache_commit(p->cache)) cache_result = "miss, written";
+  else cache_result = "miss, not written";
+
+  cache_free(&(p->cache));
+}
+
+// Without --jobs the files are read one after the other, as if they had been
+// concatenated, except that each file's forms are numbered from zero.
+
+void run_files() {
+  jserr_t err;
+  input_t in;
+
+  for (int i = 0; i < filec && !halted(); i++) {
+    open_input(&in, filev[i]);
+    p = in.p;
+    input_name = filev[i];
+
+    for (int j = 0; j < progc; j++)
+      progv[j]->source = filev[i];
+
+    while ((err = exec(progv, progc, p)) != JS_EDONE)
+      reject(err);
+
+    forms += p->forms;
+    close_cache(p);
+    close_input(&in);
+  }
+
+  p = NULL;
+}
+
+/*
+ * parallel input
+ *****************************************************************************/
+
+// With --jobs each thread takes the next input file and runs its own copy of
+// the programs on it. Each copy's rows are collected in a buffer, and written
+// out in the order the files were named: the thread working on the file that
+// is next in line writes its rows whenever a buffer fills up, the others hand
+// theirs over when they finish the file, to be written when its turn comes.
+// With --interleave full buffers are written right away, so files don't wait
+// for each other, but rows are never split.
+
+typedef struct {
+  Buffer **bufs;
+  int done;
+  jserr_t err;
+  size_t offset;
+} held_t;
+
+struct job;
+
+typedef struct {
+  struct job *job;
+  Buffer *buf;
+} sink_t;
+
+typedef struct job {
+  pthread_t thread;
+  jt_t **progv;
+  sink_t *sinks;
+  Buffer **bufs;
+  int file;
+} job_t;
+
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+held_t *held;
+int next_file = 0;
+int turn = 0;
+
+Buffer **alloc_bufs() {
+  Buffer **bufs = jmalloc(sizeof(Buffer *) * progc);
+  for (int i = 0; i < progc; i++) buf_alloc(bufs + i);
+  return bufs;
+}
+
+void free_bufs(Buffer ***bufs) {
+  for (int i = 0; i < progc; i++) buf_free(*bufs + i);
+  free(*bufs);
+  *bufs = NULL;
+}
+
+// Writes rows collected from the programs to their outputs, each program's
+// headings first if nothing has been written for it yet. Called with the
+// output lock held. When sorting or sharding, each row is kept after its
+// length instead of before a newline, because rows may contain newlines, and
+// passed on to the program's sorter or sharder.
+
+void write_held(Buffer **bufs) {
+  size_t len, off;
+
+  for (int i = 0; i < progc; i++) {
+    if (! bufs[i]->pos) continue;
+    if (sortv || shardv) {
+      for (off = 0; off < bufs[i]->pos; off += len) {
+        memcpy(&len, bufs[i]->buf + off, sizeof(size_t));
+        off += sizeof(size_t);
+        progv[i]->row(progv[i]->ctx, bufs[i]->buf + off, len);
       }
-    } else if (len >= 2 && (argv[i][0] == '%' || argv[i][0] == '^') && argv[i][1] == '=') {
-      wordv[i].cmd = argv[i][0];
-      wordv[i].text = argv[i] + 2;
-      stack_push(OUT, parse_as_string(wordv[i].text));
-      have_headers = 1;
     } else {
-      wordv[i].cmd = '\0';
-      if ((e = (argv[i][0] == '[' && argv[i][len - 1] == ']')))
-        argv[i][len -1] = '\0';
-      wordv[i].text = argv[i] + e;
+      if (!(progv[i]->rows++) && progv[i]->header)
+        write_row(progv[i]->ctx, (progv[i]->header)->buf, (progv[i]->header)->pos);
+      fwrite(bufs[i]->buf, 1, bufs[i]->pos, progv[i]->ctx);
     }
+    buf_reset(bufs[i], 0);
+  }
+}
+
+void hold_row(void *ctx, const char *row, size_t len) {
+  sink_t *sink = ctx;
+  job_t *job = sink->job;
+
+  if (sortv || shardv) {
+    buf_append(sink->buf, (const char *) &len, sizeof(size_t));
+    buf_append(sink->buf, row, len);
+  } else {
+    buf_append(sink->buf, row, len);
+    buf_write(sink->buf, '\n');
   }
-  return have_headers;
+
+  if (sink->buf->pos < JT_OUTBUFSIZE) return;
+
+  pthread_mutex_lock(&output_lock);
+  if (opt_interleave || job->file == turn) write_held(job->bufs);
+  pthread_mutex_unlock(&output_lock);
+}
+
+void finish_file(job_t *job, jserr_t err, size_t off) {
+  held_t *h = held + job->file;
+  int i;
+
+  pthread_mutex_lock(&output_lock);
+
+  h->err = err;
+  h->offset = off;
+
+  if (opt_interleave || job->file == turn) {
+    write_held(job->bufs);
+  } else {
+    h->bufs = job->bufs;
+    job->bufs = alloc_bufs();
+    for (i = 0; i < progc; i++) job->sinks[i].buf = job->bufs[i];
+  }
+
+  h->done = 1;
+
+  if (opt_interleave && err) input_error(filev[job->file], err, off);
+
+  for (; !opt_interleave && turn < filec && held[turn].done; turn++) {
+    if (held[turn].bufs) {
+      write_held(held[turn].bufs);
+      free_bufs(&(held[turn].bufs));
+    }
+    if (held[turn].err)
+      input_error(filev[turn], held[turn].err, held[turn].offset);
+  }
+
+  pthread_mutex_unlock(&output_lock);
+}
+
+void *run_job(void *arg) {
+  job_t *job = arg;
+  jserr_t err;
+  input_t in;
+  size_t off;
+  int i;
+
+  while ((job->file = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED)) < filec) {
+    open_input(&in, filev[job->file]);
+
+    for (i = 0; i < progc; i++) {
+      job->progv[i]->source = filev[job->file];
+      job->progv[i]->halt = 0;
+    }
+
+    while ((err = exec(job->progv, progc, in.p)) != JS_EDONE && opt_tolerant
+           && in.p->format == JS_JSON) {
+      off = js_resync(in.p);
+      pthread_mutex_lock(&output_lock);
+      log_reject(filev[job->file], off);
+      pthread_mutex_unlock(&output_lock);
+    }
+
+    __atomic_fetch_add(&forms, in.p->forms, __ATOMIC_RELAXED);
+    finish_file(job, err == JS_EDONE ? 0 : err, js_offset(in.p));
+    close_input(&in);
+  }
+
+  return NULL;
+}
+
+void run_jobs() {
+  int i, j, n = opt_jobs < filec ? opt_jobs : filec;
+  job_t *jobs = jmalloc(sizeof(job_t) * n);
+
+  held = jmalloc(sizeof(held_t) * filec);
+  memset(held, 0, sizeof(held_t) * filec);
+
+  for (i = 0; i < n; i++) {
+    jobs[i].progv = jmalloc(sizeof(jt_t *) * progc);
+    jobs[i].sinks = jmalloc(sizeof(sink_t) * progc);
+    jobs[i].bufs = alloc_bufs();
+
+    for (j = 0; j < progc; j++) {
+      jobs[i].sinks[j].job = jobs + i;
+      jobs[i].sinks[j].buf = jobs[i].bufs[j];
+      jt_alloc(jobs[i].progv + j, argcv[j], argvv[j], program_flags(), hold_row,
+               jobs[i].sinks + j);
+      // The headings are written by write_held().
+      if (jobs[i].progv[j]->header) buf_free(&(jobs[i].progv[j]->header));
+    }
+
+    if (pthread_create(&(jobs[i].thread), NULL, run_job, jobs + i))
+      die_err("can't create thread");
+  }
+
+  for (i = 0; i < n; i++)
+    pthread_join(jobs[i].thread, NULL);
+
+#ifdef JT_VALGRIND
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < progc; j++)
+      jt_free(jobs[i].progv + j);
+    free(jobs[i].progv);
+    free(jobs[i].sinks);
+    free_bufs(&(jobs[i].bufs));
+  }
+  free(jobs);
+  free(held);
+#endif /* JT_VALGRIND */
+}
+
+void schema() {
+  Buffer *b;
+  char digitbuf[24];
+  input_t in;
+  jserr_t err;
+  size_t i;
+  int t, n;
+
+  table_alloc(&schema_paths, 64);
+  buf_alloc(&schema_path);
+  buf_alloc(&b);
+
+  for (int f = 0; f < (filec ? filec : 1); f++) {
+    if (filec) {
+      open_input(&in, filev[f]);
+      p = in.p;
+      input_name = filev[f];
+    }
+
+    while ((err = js_skim_one(p, schema_visit, NULL)) != JS_EDONE) {
+      if (err) reject(err);
+      else js_reset(p);
+    }
+
+    if (filec) close_input(&in);
+  }
+
+  for (i = 0; i < schema_paths->count; i++) {
+    buf_reset(b, 0);
+    buf_append(b, table_key(schema_paths, i), table_len(schema_paths, i));
+    snprintf(digitbuf, sizeof(digitbuf), "\t%zu\t", schema_counts[i]);
+    buf_append(b, digitbuf, strlen(digitbuf));
+    for (t = 0, n = 0; t < 6; t++) {
+      if (!(schema_types[i] & (1 << t))) continue;
+      if (n++) buf_write(b, ',');
+      buf_append(b, schema_type_names[t], strlen(schema_type_names[t]));
+    }
+    buf_println(b);
+  }
+
+#ifdef JT_VALGRIND
+  table_free(&schema_paths);
+  buf_free(&schema_path);
+  buf_free(&b);
+  free(schema_counts);
+  free(schema_types);
+#endif /* JT_VALGRIND */
+}
+
+/*
+ * sampling
+ *****************************************************************************/
+
+// A uniform sample of the records (--reservoir) is chosen with Algorithm L:
+// once the reservoir is full, the number of records to pass over before the
+// next one that goes into it is drawn directly, so the records in between are
+// only scanned for newlines. The sampled lines are kept in one arena, each
+// slot holding the offset and length of its line. A line that goes into the
+// reservoir is appended to the arena, and the arena is compacted when more
+// than half of it is taken up by lines that have been replaced. The sample is
+// then copied out in input order, and parsed by a parser that reads it as its
+// mapped input (see js_map()), which replaces the input parser. By then stdin
+// is at its end.
+
+typedef struct {
+  size_t idx;
+  size_t off;
+  size_t len;
+} slot_t;
+
+Buffer *sample = NULL;
+
+static double uniform() {
+  return (random() + 0.5) / (RAND_MAX + 1.0);
+}
+
+static int cmp_slot_idx(const void *a, const void *b) {
+  size_t x = ((const slot_t *) a)->idx, y = ((const slot_t *) b)->idx;
+  return (x > y) - (x < y);
+}
+
+static int cmp_slot_off(const void *a, const void *b) {
+  size_t x = ((const slot_t *) a)->off, y = ((const slot_t *) b)->off;
+  return (x > y) - (x < y);
+}
+
+// Reads the next line into the arena, followed by a newline.
+
+static int read_slot(Buffer *lines, slot_t *slot, size_t idx) {
+  slot->off = lines->pos;
+  if (! js_read_line(p, lines)) return 0;
+  slot->len = lines->pos - slot->off;
+  slot->idx = idx;
+  buf_write(lines, '\n');
+  return 1;
+}
+
+static void compact_slots(Buffer *lines, slot_t *slots, size_t n) {
+  size_t i, pos = 0;
+
+  qsort(slots, n, sizeof(slot_t), cmp_slot_off);
+
+  for (i = 0; i < n; i++) {
+    memmove(lines->buf + pos, lines->buf + slots[i].off, slots[i].len + 1);
+    slots[i].off = pos;
+    pos += slots[i].len + 1;
+  }
+
+  lines->pos = pos;
+  (lines->buf)[pos] = '\0';
+}
+
+void reservoir(size_t n) {
+  slot_t *slots = jmalloc(sizeof(slot_t) * n), tmp;
+  size_t i, k, idx = 0, dead = 0;
+  double w, skip;
+  jsparser_t *q;
+  Buffer *lines;
+
+  srandom(time(NULL) ^ getpid());
+  buf_alloc(&lines);
+
+  for (k = 0; k < n && read_slot(lines, slots + k, idx); k++)
+    idx++;
+
+  if (k == n) {
+    for (w = exp(log(uniform()) / n); ; w *= exp(log(uniform()) / n)) {
+      skip = floor(log(uniform()) / log(1 - w));
+      if (skip > 1e18) skip = 1e18;
+      if (js_skip_lines(p, (size_t) skip) < (size_t) skip) break;
+      idx += (size_t) skip;
+
+      if (! read_slot(lines, &tmp, idx++)) break;
+
+      i = random() % n;
+      dead += slots[i].len + 1;
+      slots[i] = tmp;
+
+      if (dead > lines->pos / 2) {
+        compact_slots(lines, slots, n);
+        dead = 0;
+      }
+    }
+  }
+
+  qsort(slots, k, sizeof(slot_t), cmp_slot_idx);
+
+  buf_alloc(&sample);
+  buf_check(sample, lines->pos - dead);
+  for (i = 0; i < k; i++)
+    buf_append_unchecked(sample, lines->buf + slots[i].off, slots[i].len + 1);
+
+  buf_free(&lines);
+  free(slots);
+
+  js_alloc(&q, p->in, 128);
+  q->threads = p->threads;
+  q->utf8 = p->utf8;
+  q->canonical = p->canonical;
+  js_map(q, sample->buf, sample->pos);
+
+  js_free(&p);
+  p = q;
 }
 
 /*
@@ -199,7 +1016,15 @@ void usage() {
   fprintf(stderr, "Usage: jt -h\n");
   fprintf(stderr, "       jt -V\n");
   fprintf(stderr, "       jt -u <string>\n");
-  fprintf(stderr, "       jt [-acj] [COMMAND ...]\n\n");
+  fprintf(stderr, "       jt [-ar] -k\n");
+  fprintf(stderr, "       jt [-acCjlPrStT] [-e <file>] [-f <file>] [-F <file>] [-n <rows>]\n");
+  fprintf(stderr, "          [-p <threads>]\n");
+  fprintf(stderr, "          [--sample <k> | --reservoir <n>] [--jobs <n>] [--interleave]\n");
+  fprintf(stderr, "          [--filename] [--sort <keys>] [--sort-memory <MiB>]\n");
+  fprintf(stderr, "          [--shards <n>] [--shard-key <col>] [--shard-files <pattern>]\n");
+  fprintf(stderr, "          [--cache <file>] [--stats] [--format <format>] [--flatten]\n");
+  fprintf(stderr, "          [--batch <n>]\n");
+  fprintf(stderr, "          [COMMAND ...] [-- FILE ...]\n\n");
   fprintf(stderr, "Where COMMAND is one of `[', `]', `%%', `@', `.', `^', `+', or a property name.\n");
   exit(0);
 }
@@ -218,160 +1043,272 @@ void version() {
   exit(0);
 }
 
+void unescape_line(Buffer *b, char *s, size_t len) {
+  int quoted = (len >= 2 && s[0] == '\"' && s[len - 1] == '\"');
+  if (opt_csv) buf_write(b, '\"');
+  js_unescape_string(b, quoted ? s+1 : s, quoted ? len-2 : len, opt_csv);
+  if (opt_csv) buf_write(b, '\"');
+  buf_write(b, '\n');
+}
+
+// With `-u -` each line of stdin is a JSON string, with or without its
+// quotes, and is unescaped to a line of output. Input is read and output is
+// written in large blocks.
+
+void unescape_stream() {
+  Buffer *in, *out;
+  char *s, *nl, *end;
+  ssize_t n;
+
+  buf_alloc(&in);
+  buf_alloc(&out);
+
+  do {
+    buf_check(in, JT_OUTBUFSIZE);
+    while ((n = read(STDIN_FILENO, in->buf + in->pos, JT_OUTBUFSIZE)) < 0 && errno == EINTR);
+    if (n < 0) die_err("can't read input");
+    (in->buf)[in->pos += n] = '\0';
+
+    s = in->buf;
+    end = in->buf + in->pos;
+
+    while ((nl = memchr(s, '\n', end - s)) || (!n && s < end)) {
+      unescape_line(out, s, (nl ? nl : end) - s);
+      s = nl ? nl + 1 : end;
+
+      if (out->pos >= JT_OUTBUFSIZE) {
+        fwrite(out->buf, 1, out->pos, stdout);
+        buf_reset(out, 0);
+      }
+    }
+
+    if (s > in->buf) buf_reset(in, s - in->buf);
+  } while (n);
+
+  fwrite(out->buf, 1, out->pos, stdout);
+  exit(0);
+}
+
 void unescape(char *s) {
-  int len = strlen(s), quoted = (len > 2 && s[0] == '\"' && s[len - 1] == '\"');
-  if (opt_csv) buf_write(OUTBUF, '\"');
-  js_unescape_string(OUTBUF, quoted ? s+1 : s, quoted ? len-2 : len, opt_csv);
-  if (opt_csv) buf_write(OUTBUF, '\"');
-  buf_println(OUTBUF);
+  Buffer *b;
+
+  if (!strcmp(s, "-")) unescape_stream();
+
+  buf_alloc(&b);
+  unescape_line(b, s, strlen(s));
+  fwrite(b->buf, 1, b->pos, stdout);
   exit(0);
 }
 
 int main(int argc, char *argv[]) {
-  size_t root = 0, idx = 0, wordc = 0, bpos = 0, ppos = 0;
-  word_t *wordv;
+  static const struct option longopts[] = {
+    {"sample",    required_argument, NULL, 'K'},
+    {"reservoir", required_argument, NULL, 'R'},
+    {"jobs",       required_argument, NULL, 'J'},
+    {"interleave", no_argument,       NULL, 'I'},
+    {"filename",   no_argument,       NULL, 'L'},
+    {"sort",        required_argument, NULL, 'O'},
+    {"sort-memory", required_argument, NULL, 'M'},
+    {"shards",      required_argument, NULL, 'N'},
+    {"shard-key",   required_argument, NULL, 'Y'},
+    {"shard-files", required_argument, NULL, 'W'},
+    {"cache",       required_argument, NULL, 'X'},
+    {"stats",       no_argument,       NULL, 'Z'},
+    {"format",      required_argument, NULL, 'D'},
+    {"flatten",     no_argument,       NULL, 'G'},
+    {"batch",       required_argument, NULL, 'B'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *progfile = NULL;
+  FILE *in;
   jserr_t err;
-  int opt;
-
-  if (! (devnull = fopen("/dev/null", "r")))
-    die_err("can't open /dev/null");
+  size_t n;
+  int opt, i;
 
-  buf_alloc(&OUTBUF);
-
-  while ((opt = getopt(argc, argv, "+hVacjsu:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "+hVacCjklPrsStTu:e:f:F:n:p:", longopts, NULL)) != -1) {
     switch (opt) {
       case 'h': usage();          break;
       case 'V': version();        break;
       case 'u': unescape(optarg); break;
       case 'a': opt_iter = 1;     break;
       case 'c': opt_csv  = 1;     break;
+      case 'C': opt_canonical = 1; break;
       case 'j': opt_join = 1;     break;
+      case 'k': opt_keys = 1;     break;
+      case 'l': opt_lines = 1;    break;
+      case 'r': opt_reader = 1;   break;
+      case 'P': opt_pipeline = 1; break;
+      case 'T': opt_trust = 1;    break;
       case 's': /* no-op */       break;
+      case 'S': opt_sketch = 1;   break;
+      case 't': opt_tolerant = 1; break;
+      case 'e':
+        if (! (rejects_out = fopen(optarg, "w")))
+          die_err("can't open rejects file: %s", optarg);
+        break;
+      case 'f': progfile = optarg; break;
+      case 'F':
+        opt_follow = optarg;
+        opt_lines = 1;
+        break;
+      case 'p':
+        if ((n = strtosizet(optarg)) < 1 || n > JT_MAXTHREADS)
+          die("invalid number of threads: %s", optarg);
+        opt_threads = (int) n;
+        break;
+      case 'n':
+        if ((opt_limit = strtosizet(optarg)) < 1 || opt_limit == SIZE_MAX)
+          die("invalid number of rows: %s", optarg);
+        break;
+      case 'K':
+        if ((opt_sample = strtosizet(optarg)) < 1 || opt_sample == SIZE_MAX)
+          die("invalid sample interval: %s", optarg);
+        break;
+      case 'R':
+        if ((opt_reservoir = strtosizet(optarg)) < 1 || opt_reservoir == SIZE_MAX)
+          die("invalid sample size: %s", optarg);
+        break;
+      case 'J':
+        if ((n = strtosizet(optarg)) < 1 || n > JT_MAXTHREADS)
+          die("invalid number of jobs: %s", optarg);
+        opt_jobs = (int) n;
+        break;
+      case 'I': opt_interleave = 1; break;
+      case 'L': opt_filename = 1;   break;
+      case 'O': parse_sort_keys(optarg); break;
+      case 'N':
+        if ((n = strtosizet(optarg)) < 1 || n > JT_MAXSHARDS)
+          die("invalid number of shards: %s", optarg);
+        opt_shards = (int) n;
+        break;
+      case 'Y':
+        if ((n = strtosizet(optarg)) < 1 || n > JT_STACKSIZE)
+          die("invalid shard key: %s", optarg);
+        opt_shard_key = (int) n - 1;
+        break;
+      case 'W': opt_shard_files = optarg; break;
+      case 'X': opt_cache = optarg; break;
+      case 'Z': opt_stats = 1;      break;
+      case 'D': opt_format = parse_format(optarg); break;
+      case 'G': opt_flatten = 1;    break;
+      case 'B':
+        if ((opt_batch = strtosizet(optarg)) < 1 || opt_batch > JT_MAXBATCH)
+          die("invalid batch size: %s", optarg);
+        break;
+      case 'M':
+        if ((opt_sort_memory = strtosizet(optarg)) < 1 || opt_sort_memory > SIZE_MAX >> 21)
+          die("invalid sort memory: %s", optarg);
+        break;
       default:  exit(1);
     }
   }
 
-  if (argc - optind == 0) usage();
-
-  wordc = argc - optind;
-  wordv = jmalloc(sizeof(word_t) * argc - optind);
-
-  stack_alloc(&DAT, "data",     JT_STACKSIZE);
-  stack_alloc(&OUT, "output",   JT_STACKSIZE);
-  stack_alloc(&SUB, "gosub",    JT_STACKSIZE);
-  stack_alloc(&ITR, "iterator", JT_STACKSIZE);
-  stack_alloc(&IDX, "index",    JT_STACKSIZE);
-
-  js_alloc(&p, stdin, 128);
-
-  if (parse_commands(argc - optind, argv + optind, wordv)) {
-    print_stack(OUT);
-    buf_write(OUTBUF, '\n');
-  }
-  stack_pop_to(OUT, -1);
-  js_reset(p);
-
-  while ((err = js_parse_one(p, &root)) != JS_EDONE) {
-    if (err) die("can't parse JSON");
-
-    // The input buffer now looks something like this:
-    //
-    //    [XXXXXXYYYY--------]
-    //           ^   ^
-    //           pp  bp
-    //
-    // where the Xs are the bytes in the current JSON object just read from
-    // stdin, the Ys are more bytes read from stdin but which are not part of
-    // the current JSON object and have not yet been parsed. The pp and bp
-    // pointers point to the end of the parsed input and the end of bytes read
-    // from stdin. The minuses indicate bytes in the input buffer than have
-    // been allocated but are not being used at the moment.
-    //
-    // The + command parses nested JSON (JSON embedded in strings, xzibit style).
-    // For this to work we need space in the input buffer to write out the JSON
-    // unescaped contents of those strings. We use the end of the input buffer
-    // for this purpose, by moving pp to coincide with bp:
-    //
-    //    [XXXXXXYYYY--------]
-    //               ^
-    //               pp
-    //               bp
-    //
-    // Now if the + command needs to parse some JSON it writes the unescaped
-    // string contents to the input buffer:
-    //
-    //    [XXXXXXYYYYZZZZZ---]
-    //               ^    ^
-    //               pp   bp
-    //
-    // And then parses it:
-    //
-    //    [XXXXXXYYYYZZZZZ---]
-    //                    ^
-    //                    bp
-    //                    pp
-    //
-    // Additionally, we set the parser's input stream to /dev/null to prevent
-    // it from reading any bytes from stdin into the scratch space at the end
-    // of the input buffer that we're using for the nested JSON. A situation
-    // like this would be difficult to manage:
-    //
-    //    [XXXXXXYYYYZZZZZYYYZZZZYY----]
-    //
-    // When all the commands have finished executing for the current JSON
-    // object (i.e. the XXXXXX bytes) we must restore the input buffer pointers
-    // to their original states:
-    //
-    //    [XXXXXXYYYYZZZZZ---]
-    //           ^   ^
-    //           pp  bp
-    //
-    // This way we continue parsing from where we left off, and the Zs get
-    // overwritten by bytes read from stdin (more Ys).
-
-    bpos = (p->js)->pos;
-    ppos = p->pos;
-    p->pos = bpos;
-    p->in = devnull;
-
-    stack_push(IDX, js_create_index(p, idx++));
-    stack_push(DAT, root);
-
-    do {
-      if (run(wordc, wordv) > 0) {
-        print_stack(OUT);
-        buf_println(OUTBUF);
-        buf_reset(OUTBUF, 0);
-      }
+  // Input files follow a `--` word. With -k or --flatten there are no
+  // commands, so that word ends the options.
+  if ((opt_keys || opt_flatten) && !strcmp(argv[optind - 1], "--")) i = optind - 1;
+  else for (i = optind; i < argc && strcmp(argv[i], "--"); i++);
 
-      stack_pop_to(DAT, 0);
-      stack_pop_to(OUT, -1);
-      stack_pop_to(SUB, -1);
-    } while (stack_depth(ITR) > 0);
+  if (i < argc) {
+    filec = argc - i - 1;
+    filev = argv + i + 1;
+    argc = i;
+  }
 
-    // Restore parser to the saved state.
-    (p->js)->pos = bpos;
-    p->pos = ppos;
-    p->in = stdin;
+  if (argc - optind == 0 && !progfile && !opt_keys && !opt_flatten) usage();
 
-    js_reset(p);
-    stack_pop_to(DAT, -1);
-    stack_pop_to(IDX, -1);
+  if (filec && opt_reservoir) die("can't sample input files with --reservoir");
+  if (opt_sample && opt_reservoir) die("can't use --sample with --reservoir");
+  if (filec && opt_follow) die("can't follow a file and read input files");
+  if (opt_shards && sort_keyc) die("can't sort and shard the output");
+  if (opt_flatten && (argc > optind || progfile || opt_sketch))
+    die("--flatten doesn't take commands or -S");
+  if (opt_batch && (opt_pipeline || opt_follow)) die("can't batch forms with -P or -F");
+  // Binary input is only read form by form.
+  if (opt_keys || opt_sample || opt_reservoir) {
+    if (opt_format == JS_MSGPACK || opt_format == JS_CBOR)
+      die("can't sample or list the keys of MessagePack or CBOR input");
+    opt_format = JS_JSON;
   }
 
-#ifdef JT_VALGRIND
-  js_free(&p);
+  if (opt_cache && (filec > 1 || opt_follow || opt_keys || opt_sample || opt_reservoir))
+    die("--cache only works with a single input file, read completely");
+
+  if (opt_follow) {
+    if (! (in = fopen(opt_follow, "r")))
+      die_err("can't open input file: %s", opt_follow);
+    js_alloc(&p, in, 128);
+    setup_parser(p);
+    reader_alloc(&(p->reader), in, opt_follow);
+    input_name = opt_follow;
+  } else if (! filec) {
+    js_alloc(&p, stdin, 128);
+    setup_parser(p);
+    if (opt_cache && open_cache(p, stdin)) opt_reader = 0;
+    if (opt_reader) reader_alloc(&(p->reader), stdin, NULL);
+  }
+
+  // In line mode (-l) rows are written as soon as they're ready.
+  setvbuf(stdout, NULL, opt_lines ? _IOLBF : _IOFBF, JT_OUTBUFSIZE);
+
+  if (opt_keys) {
+    schema();
+    if (rejects) warn("skipped %zu bad records", rejects);
+    exit(0);
+  }
+
+  if (progfile) load_programs(progfile);
+  if (opt_flatten) add_program(0, argv + optind, NULL);
+  else add_programs(argc - optind, argv + optind);
+
+  for (i = 0; i < progc; i++) {
+    progv[i]->limit = opt_limit;
+    progv[i]->source = "-";
+  }
+
+  if (sort_keyc && !opt_sketch) add_sorters();
+  if (opt_shards && !opt_sketch) add_sharders();
 
-  buf_free(&OUTBUF);
+  // Row limits and sketches apply to all of the input, so then the files are
+  // read one at a time.
+  if (filec && opt_jobs > 1 && (!opt_limit || sortv) && !opt_sketch && !opt_cache) {
+    run_jobs();
+  } else if (filec) {
+    run_files();
+  } else {
+    if (opt_reservoir) reservoir(opt_reservoir);
+
+    while ((err = exec(progv, progc, p)) != JS_EDONE)
+      reject(err);
+
+    forms += p->forms;
+    close_cache(p);
+  }
+
+  if (rejects) warn("skipped %zu bad records", rejects);
 
-  stack_free(&DAT);
-  stack_free(&OUT);
-  stack_free(&SUB);
-  stack_free(&ITR);
-  stack_free(&IDX);
+  if (opt_stats) {
+    warn("read %zu forms", forms);
+    if (cache_result) warn("cache %s: %s", cache_result, opt_cache);
+  }
 
-  free(wordv);
-  fclose(devnull);
+  if (sortv) finish_sorters();
+  if (shardv) finish_sharders();
+
+  if (opt_sketch)
+    for (i = 0; i < progc; i++) print_sketches(progv[i]);
+
+#ifdef JT_VALGRIND
+  if (p) js_free(&p);
+  if (sample) buf_free(&sample);
+
+  for (i = 0; i < progc; i++) {
+    jt_free(progv + i);
+    free(argvv[i]);
+  }
+  free(progv);
+  free(destv);
+  free(argcv);
+  free(argvv);
 #endif /* JT_VALGRIND */
 
   return 0;
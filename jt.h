@@ -0,0 +1,123 @@
+/*
+ * libjt: transform JSON into tabular data
+ *****************************************************************************/
+
+#ifndef JT_H
+#define JT_H
+
+#include "stack.h"
+#include "buffer.h"
+#include "js.h"
+#include "util.h"
+
+#ifndef JT_STACKSIZE
+#define JT_STACKSIZE 256
+#endif
+
+#ifndef JT_PIPEDEPTH
+#define JT_PIPEDEPTH 64
+#endif
+
+#ifndef JT_BATCHBYTES
+#define JT_BATCHBYTES (1 << 16)
+#endif
+
+// flags for jt_alloc()
+
+#define JT_JOIN (1 << 0)
+#define JT_ITER (1 << 1)
+#define JT_CSV  (1 << 2)
+#define JT_SOURCE (1 << 3)
+#define JT_FLATTEN (1 << 4)
+
+// errors from jt_alloc()
+
+typedef enum {
+  JT_OKAY,
+  JT_EKEY,
+  JT_EBRACKET
+} jterr_t;
+
+// Called with each row of output, not including the trailing newline. The
+// row is only valid until the callback returns.
+
+typedef void (*jtrow_t)(void *ctx, const char *row, size_t len);
+
+// Called instead of the row callback, if set, with the tokens of each row's
+// columns (zero for an empty column) instead of the formatted row.
+
+typedef void (*jtcols_t)(void *ctx, jsparser_t *p, const size_t *toks, int n);
+
+typedef struct {
+  char cmd;
+  char *text;
+  int group;
+  int slot;
+} jtword_t;
+
+// The property names a query looks up on the same object, and the values
+// found for them in the object that was searched last.
+
+#define JT_KEYHASH 64
+
+typedef struct {
+  int keyc;
+  const char **keyv;
+  size_t *lenv;
+  int *next;
+  int hash[JT_KEYHASH];
+  size_t obj;
+  size_t gen;
+  size_t *vals;
+} jtgroup_t;
+
+typedef struct {
+  int opt_join;
+  int opt_iter;
+  int opt_csv;
+  int opt_source;
+  int opt_flatten;
+  const char *source;
+  int wordc;
+  jtword_t *wordv;
+  char *words;
+  int groupc;
+  jtgroup_t *groupv;
+  size_t gen;
+  const char *scan;
+  int *srcv;
+  char *eachv;
+  size_t *colv;
+  char *skipv;
+  size_t batchc;
+  Buffer *header;
+  Buffer *buf;
+  Buffer *path;
+  size_t rows;
+  size_t limit;
+  int halt;
+  jsparser_t *p;
+  Stack *DAT;
+  Stack *OUT;
+  Stack *SUB;
+  Stack *IDX;
+  jtrow_t row;
+  void *ctx;
+  jtcols_t cols;
+  void *cols_ctx;
+} jt_t;
+
+// queries
+
+jterr_t jt_alloc(jt_t **jt, int argc, char *argv[], int flags, jtrow_t row, void *ctx);
+void jt_free(jt_t **jt);
+const char *jt_error(jterr_t err);
+
+// evaluation
+
+void jt_run(jt_t *jt, jsparser_t *p, size_t root, size_t idx);
+jserr_t jt_exec(jt_t **jtv, int jtc, jsparser_t *p);
+jserr_t jt_exec_pipelined(jt_t **jtv, int jtc, jsparser_t *p);
+jserr_t jt_exec_batched(jt_t **jtv, int jtc, jsparser_t *p, size_t n);
+
+#endif
@@ -0,0 +1,1102 @@
+/*
+ * libjt: transform JSON into tabular data
+ *****************************************************************************/
+
+#include "jt.h"
+#include "ring.h"
+
+/*
+ * helpers
+ *****************************************************************************/
+
+static void print_tok(jt_t *jt, size_t t) {
+  if (!t) return;
+  if (jt->opt_csv) buf_write(jt->buf, '\"');
+  js_print(jt->p, t, jt->buf, 0, jt->opt_csv);
+  if (jt->opt_csv) buf_write(jt->buf, '\"');
+}
+
+// With JT_SOURCE each printed row starts with a column naming the input it
+// came from (jt->source).
+
+static void print_source(jt_t *jt) {
+  const char *s = jt->source ? jt->source : "";
+
+  if (jt->opt_csv) {
+    buf_write(jt->buf, '\"');
+    buf_append_csv(jt->buf, s, strlen(s));
+    buf_write(jt->buf, '\"');
+    buf_write(jt->buf, ',');
+  } else {
+    buf_append(jt->buf, s, strlen(s));
+    buf_write(jt->buf, '\t');
+  }
+}
+
+static void print_stack(jt_t *jt, Stack *s) {
+  for (int i = 0; i <= s->head; i++) {
+    print_tok(jt, (s->items)[i]);
+    if (i < s->head) buf_write(jt->buf, jt->opt_csv ? ',' : '\t');
+  }
+}
+
+// The column headings, if any, are emitted just before the first row. A query
+// with a row limit halts when it has printed that many rows.
+
+static void emit_row(jt_t *jt) {
+  if (!(jt->rows++) && jt->header)
+    jt->row(jt->ctx, (jt->header)->buf, (jt->header)->pos);
+  jt->row(jt->ctx, (jt->buf)->buf, (jt->buf)->pos);
+  buf_reset(jt->buf, 0);
+  if (jt->limit && jt->rows >= jt->limit) jt->halt = 1;
+}
+
+static void print_row(jt_t *jt, int cols) {
+  if (cols > 0 && jt->cols) {
+    jt->rows++;
+    jt->cols(jt->cols_ctx, jt->p, (jt->OUT)->items, (jt->OUT)->head + 1);
+    if (jt->limit && jt->rows >= jt->limit) jt->halt = 1;
+  } else if (cols > 0) {
+    if (jt->opt_source) print_source(jt);
+    print_stack(jt, jt->OUT);
+    emit_row(jt);
+  }
+}
+
+static void add_heading(jt_t *jt, const char *s, int col) {
+  Buffer *h = jt->header;
+  if (col) buf_write(h, jt->opt_csv ? ',' : '\t');
+  if (jt->opt_csv) {
+    buf_write(h, '\"');
+    js_unescape_string(h, (char *) s, strlen(s), 1);
+    buf_write(h, '\"');
+  } else {
+    buf_append(h, s, strlen(s));
+  }
+}
+
+// The words are copied, because parsing them modifies them. The `**` command
+// and the key that follows it make a single word.
+
+static void parse_commands(jt_t *jt, int argc, char *argv[]) {
+  int i, j, len, e, cols = 0, have_headers = 0, deep = 0;
+  size_t size = 0;
+  jtword_t *wordv;
+  char *w;
+
+  for (i = 0; i < argc; i++)
+    size += strlen(argv[i]) + 1;
+
+  jt->wordv = wordv = jmalloc(sizeof(jtword_t) * (argc ? argc : 1));
+  jt->words = w = jmalloc(size ? size : 1);
+  buf_alloc(&(jt->header));
+
+  if (jt->opt_source) add_heading(jt, "file", cols++);
+
+  for (i = j = 0; i < argc; i++, w += len + 1) {
+    len = strlen(argv[i]);
+    memcpy(w, argv[i], len + 1);
+    wordv[j].group = -1;
+    if (deep) {
+      wordv[j].cmd = '*';
+      if ((e = (w[0] == '[' && w[len - 1] == ']')))
+        w[len -1] = '\0';
+      wordv[j++].text = w + e;
+      deep = 0;
+    } else if (len == 2 && w[0] == '*' && w[1] == '*') {
+      deep = 1;
+    } else if (len == 1) {
+      switch(w[0]) {
+        case '[': case ']': case '@': case '.': case '+':
+          wordv[j].cmd = w[0];
+          wordv[j++].text = NULL;
+          break;
+        case '%': case '^':
+          wordv[j].cmd = w[0];
+          wordv[j++].text = NULL;
+          add_heading(jt, "", cols++);
+          break;
+        default:
+          wordv[j].cmd = '\0';
+          wordv[j++].text = w;
+      }
+    } else if (len >= 2 && (w[0] == '%' || w[0] == '^') && w[1] == '=') {
+      wordv[j].cmd = w[0];
+      wordv[j].text = w + 2;
+      add_heading(jt, wordv[j++].text, cols++);
+      have_headers = 1;
+    } else {
+      wordv[j].cmd = '\0';
+      if ((e = (w[0] == '[' && w[len - 1] == ']')))
+        w[len -1] = '\0';
+      wordv[j++].text = w + e;
+    }
+  }
+
+  jt->wordc = j;
+
+  if (!have_headers) buf_free(&(jt->header));
+}
+
+// A query whose first command is `**` never looks at anything in the form but
+// the values it finds, unless a `]` pops the data stack back to the form, so
+// the parser can scan the form for the key instead of parsing all of it (see
+// js_scan_one()). The form's token then only holds the members with the key.
+
+static void check_scan(jt_t *jt) {
+  int i, subc = 0;
+
+  jt->scan = NULL;
+
+  if (!jt->wordc || jt->wordv[0].cmd != '*') return;
+
+  for (i = 1; i < jt->wordc; i++) {
+    if (jt->wordv[i].cmd == '[') subc++;
+    else if (jt->wordv[i].cmd == ']' && !subc--) return;
+  }
+
+  jt->scan = jt->wordv[0].text;
+}
+
+// Property names that are looked up on the same object are grouped, so that
+// they can all be found in one pass over the object's members. The object a
+// name applies to is worked out by following the data stack through the
+// program: each lookup pushes a new node, and `]` pops back to the node that
+// was on top at the matching `[`. Iteration only changes which object a node
+// stands for at run time, which is why the results are kept per object.
+
+// A group's keys are hashed on their length and first and last bytes, which
+// is cheap to compute for each member of an object and tells most keys apart.
+
+static int key_hash(const char *s, size_t len) {
+  if (!len) return 0;
+  return (len * 31 + (unsigned char) s[0] * 7 + (unsigned char) s[len - 1]) % JT_KEYHASH;
+}
+
+static int add_key(jt_t *jt, int group, const char *key) {
+  jtgroup_t *g = jt->groupv + group;
+  size_t len = strlen(key);
+  int i, h = key_hash(key, len);
+
+  for (i = 0; i < g->keyc; i++)
+    if (!strcmp(g->keyv[i], key)) return i;
+
+  g->keyv = jrealloc(g->keyv, sizeof(char *) * (g->keyc + 1));
+  g->lenv = jrealloc(g->lenv, sizeof(size_t) * (g->keyc + 1));
+  g->next = jrealloc(g->next, sizeof(int) * (g->keyc + 1));
+  g->vals = jrealloc(g->vals, sizeof(size_t) * (g->keyc + 1));
+  g->keyv[g->keyc] = key;
+  g->lenv[g->keyc] = len;
+  g->next[g->keyc] = g->hash[h];
+  g->hash[h] = g->keyc;
+
+  return g->keyc++;
+}
+
+static void group_lookups(jt_t *jt) {
+  int node[JT_STACKSIZE], sub[JT_STACKSIZE], groups[jt->wordc + 1];
+  int i, dat = 0, subc = 0, nodes = 1;
+  jtword_t *w;
+
+  node[0] = 0;
+  groups[0] = -1;
+
+  for (i = 0; i < jt->wordc; i++) {
+    w = jt->wordv + i;
+
+    switch (w->cmd) {
+      case '[':
+        if (subc < JT_STACKSIZE) sub[subc++] = dat;
+        break;
+      case ']':
+        if (subc) dat = sub[--subc];
+        break;
+      case '\0':
+        if (groups[node[dat]] < 0) {
+          jt->groupv = jrealloc(jt->groupv, sizeof(jtgroup_t) * (jt->groupc + 1));
+          memset(jt->groupv + jt->groupc, 0, sizeof(jtgroup_t));
+          memset(jt->groupv[jt->groupc].hash, -1, sizeof(int) * JT_KEYHASH);
+          groups[node[dat]] = jt->groupc++;
+        }
+        w->group = groups[node[dat]];
+        w->slot = add_key(jt, w->group, w->text);
+        // fall through
+      case '+':
+      case '.':
+      case '*':
+        if (dat + 1 == JT_STACKSIZE) return;
+        groups[nodes] = -1;
+        node[++dat] = nodes++;
+        break;
+    }
+  }
+}
+
+// A query made only of lookups, `[`, `]`, `%` and `^` does the same thing to
+// the stacks for every form, as long as it doesn't iterate over an array, so
+// it can be run on a batch of forms one command at a time (see run_batch()).
+// For each command this works out which value is on top of the data stack
+// when it runs: the form (0), or the value found by command i - 1 (i). Queries
+// that could overflow or underflow a stack are left to run().
+//
+// A `%` that's followed by `]`, or by nothing, can also iterate over an array
+// (see batch_row()), as long as no later command uses the array, because then
+// only its items are printed and nothing else sees them.
+
+static void check_batch(jt_t *jt) {
+  int node[JT_STACKSIZE], sub[JT_STACKSIZE];
+  int i, j, dat = 0, subc = 0, outc = 0, ok = !jt->opt_flatten;
+
+  jt->srcv = jmalloc(sizeof(int) * (jt->wordc + 1));
+  jt->eachv = jmalloc(jt->wordc + 1);
+  node[0] = 0;
+
+  for (i = 0; ok && i < jt->wordc; i++) {
+    jt->srcv[i] = node[dat];
+
+    switch (jt->wordv[i].cmd) {
+      case '%':
+      case '^':
+        ok = ++outc < JT_STACKSIZE;
+        break;
+      case '[':
+        if ((ok = subc + 1 < JT_STACKSIZE)) sub[subc++] = dat;
+        break;
+      case ']':
+        if ((ok = subc > 0)) dat = sub[--subc];
+        break;
+      case '\0':
+        if ((ok = dat + 2 < JT_STACKSIZE)) node[++dat] = i + 1;
+        break;
+      default:
+        ok = 0;
+    }
+  }
+
+  for (i = 0; ok && i < jt->wordc; i++) {
+    jt->eachv[i] = jt->wordv[i].cmd == '%'
+      && (i + 1 == jt->wordc || jt->wordv[i + 1].cmd == ']');
+    for (j = i + 2; jt->eachv[i] && j < jt->wordc; j++)
+      if (jt->srcv[j] == jt->srcv[i]) jt->eachv[i] = 0;
+  }
+
+  if (!ok) {
+    free(jt->srcv);
+    free(jt->eachv);
+    jt->srcv = NULL;
+    jt->eachv = NULL;
+  }
+}
+
+/*
+ * interpreter
+ *****************************************************************************/
+
+// Finds all of the keys in a group in one pass over the object's members,
+// stopping when they've all been found. Each member's key is only compared
+// with the group's keys that have the same hash, usually none or one.
+
+static void resolve_group(jt_t *jt, jtgroup_t *g, size_t obj) {
+  jsparser_t *p = jt->p;
+  int i, left = g->keyc;
+  const char *key;
+  jstok_t *tok;
+  size_t v, len;
+
+  g->obj = obj;
+  g->gen = jt->gen;
+  memset(g->vals, 0, sizeof(size_t) * g->keyc);
+
+  for (v = js_tok(p, obj)->first_child; v && left; v = tok->next_sibling) {
+    tok = js_tok(p, v);
+    key = (p->js)->buf + tok->start;
+    len = tok->end - tok->start;
+    for (i = g->hash[key_hash(key, len)]; i >= 0; i = g->next[i]) {
+      if (!g->vals[i] && g->lenv[i] == len && !memcmp(g->keyv[i], key, len)) {
+        g->vals[i] = tok->first_child;
+        left--;
+        break;
+      }
+    }
+  }
+}
+
+static size_t lookup(jt_t *jt, jtword_t *w, size_t obj) {
+  jtgroup_t *g;
+
+  if (w->group < 0) return js_obj_get(jt->p, obj, w->text);
+
+  g = jt->groupv + w->group;
+  if (g->obj != obj || g->gen != jt->gen) resolve_group(jt, g, obj);
+
+  return g->vals[w->slot];
+}
+
+// The value the lookup command w finds in d, zero if there isn't one.
+
+static size_t get(jt_t *jt, jtword_t *w, size_t d) {
+  if (!d || !js_is_collection(js_tok(jt->p, d))) return 0;
+
+  return js_is_object(js_tok(jt->p, d))
+    ? lookup(jt, w, d)
+    : js_array_get(jt->p, d, strtosizet(w->text));
+}
+
+// Returns the member (pair or item) of the collection d, or of a collection
+// nested in it, that follows the member m (zero for the first one). Members
+// are visited depth first, in the order they appear in the input. With a key,
+// only the pairs with that key are returned, at any depth; without one, only
+// d's own members are.
+
+static size_t next_member(jsparser_t *p, size_t d, size_t m, const char *key) {
+  size_t len;
+  jstok_t *tok;
+
+  if (!key) return m ? js_tok(p, m)->next_sibling : js_tok(p, d)->first_child;
+
+  for (len = strlen(key); ; ) {
+    if (!m) {
+      m = js_tok(p, d)->first_child;
+    } else if ((tok = js_tok(p, js_tok(p, m)->first_child))->first_child &&
+               js_is_collection(tok)) {
+      m = tok->first_child;
+    } else {
+      while (!js_tok(p, m)->next_sibling && js_tok(p, m)->parent != d)
+        m = js_tok(p, js_tok(p, m)->parent)->parent;
+      m = js_tok(p, m)->next_sibling;
+    }
+
+    if (!m) return 0;
+
+    tok = js_tok(p, m);
+    if (js_is_pair(tok) && tok->end - tok->start == len &&
+        !memcmp((p->js)->buf + tok->start, key, len))
+      return m;
+  }
+}
+
+// Runs the remaining commands once for each member of d (see next_member()),
+// with the member pushed onto the index stack and its value onto the data
+// stack. The `]` command may pop the data and gosub stacks below this point,
+// and the items there may then be overwritten, so they're restored before
+// each iteration.
+
+static void run(jt_t *jt, int wordc, jtword_t *wordv, int cols);
+
+static void run_each(jt_t *jt, size_t d, const char *key, int wordc, jtword_t *wordv,
+                     int cols) {
+  jsparser_t *p = jt->p;
+  Stack *DAT = jt->DAT, *OUT = jt->OUT, *SUB = jt->SUB, *IDX = jt->IDX;
+  int dat = DAT->head, out = OUT->head, sub = SUB->head;
+  // One spare slot each, since a stack may be empty (head is -1).
+  size_t datv[dat + 2], subv[sub + 2], itr;
+
+  memcpy(datv, DAT->items, sizeof(size_t) * (dat + 1));
+  memcpy(subv, SUB->items, sizeof(size_t) * (sub + 1));
+
+  for (itr = next_member(p, d, 0, key); itr; itr = next_member(p, d, itr, key)) {
+    stack_push(IDX, itr);
+    stack_push(DAT, js_tok(p, itr)->first_child);
+    run(jt, wordc, wordv, cols);
+    stack_pop(IDX);
+
+    memcpy(DAT->items, datv, sizeof(size_t) * (dat + 1));
+    memcpy(SUB->items, subv, sizeof(size_t) * (sub + 1));
+
+    stack_pop_to(DAT, dat);
+    stack_pop_to(OUT, out);
+    stack_pop_to(SUB, sub);
+  }
+}
+
+// Iteration is evaluated as a nested loop: the commands before an iteration
+// point are executed once, and only the commands after it are executed again
+// for each item. A row is printed when the last command has been executed and
+// the number of columns pushed onto the output stack on the way there (cols)
+// is positive. Join failures cut off the remaining commands, so no row.
+
+static void run(jt_t *jt, int wordc, jtword_t *wordv, int cols) {
+  jsparser_t *p = jt->p;
+  Stack *DAT = jt->DAT, *OUT = jt->OUT, *SUB = jt->SUB, *IDX = jt->IDX;
+  size_t d = stack_head(DAT), tmp, root;
+  int e = 0;
+
+  if (jt->halt) return;
+
+  if (wordc <= 0) {
+    print_row(jt, cols);
+    return;
+  }
+
+  if ((e = (wordv[0].cmd == '.')) || (d && js_is_array(js_tok(p, d)) && !jt->opt_iter)) {
+    if (!d) {
+      stack_push(DAT, 0);
+      if (!jt->opt_join) print_row(jt, cols);
+    } else if (!js_is_collection(js_tok(p, d)) || js_is_empty(js_tok(p, d))) {
+      // Columns pushed by the remaining commands don't count towards the
+      // row's total, so a row is printed only if cols was already positive.
+      stack_push(DAT, 0);
+      if (!jt->opt_join)
+        run(jt, wordc - e, wordv + e, cols > 0 ? cols : -wordc);
+    } else {
+      run_each(jt, d, NULL, wordc - e, wordv + e, cols);
+    }
+    return;
+  } else if (wordv[0].cmd == '*') {
+    if (d && js_is_collection(js_tok(p, d)) && next_member(p, d, 0, wordv[0].text)) {
+      run_each(jt, d, wordv[0].text, wordc - 1, wordv + 1, cols);
+    } else {
+      stack_push(DAT, 0);
+      if (!jt->opt_join)
+        run(jt, wordc - 1, wordv + 1, cols > 0 ? cols : -wordc);
+    }
+    return;
+  } else {
+    switch (wordv[0].cmd) {
+      case '^':
+        cols++;
+        stack_push(OUT, stack_head(IDX));
+        break;
+      case '%':
+        cols++;
+        stack_push(OUT, d);
+        break;
+      case '+':
+        if (js_tok(p, d)->parsed) {
+          stack_push(DAT, js_tok(p, d)->parsed);
+        } else if (js_is_string(js_tok(p, d))) {
+          // The string is unescaped into the input buffer, so make room for
+          // it before taking a pointer into that buffer.
+          buf_check(p->js, js_len(p, d));
+          js_unescape_string(p->js, js_buf(p, d), js_len(p, d), 0);
+          if (! js_parse_one(p, &root)) {
+            js_tok(p, d)->parsed = root;
+            stack_push(DAT, root);
+          }
+        }
+        break;
+      case '[':
+        stack_push(SUB, stack_depth(DAT));
+        break;
+      case ']':
+        while (stack_depth(DAT) != stack_head(SUB))
+          stack_pop(DAT);
+        stack_pop(SUB);
+        break;
+      case '\0':
+        if (! ((tmp = get(jt, wordv, d)) || !jt->opt_join)) return;
+        stack_push(DAT, tmp);
+        break;
+      case '@':
+        js_print_info(p, d, jt->buf);
+        emit_row(jt);
+        jt->halt = 1;
+        return;
+    }
+  }
+
+  run(jt, wordc - 1, wordv + 1, cols);
+}
+
+/*
+ * flattening
+ *****************************************************************************/
+
+// A query made with JT_FLATTEN has no commands. Instead, every leaf of the
+// form (a value that isn't a collection, or an empty collection) is printed
+// as a row of the form's index, the leaf's path and its value. The path is a
+// JSON pointer (RFC 6901) built up in one buffer as the tree is walked: each
+// member appends its key or index, and the buffer is cut back after it.
+
+// Keys are appended as they appear in the input, with `~` and `/` (also when
+// escaped as `\/`) written as `~0` and `~1`.
+
+static void append_key(Buffer *b, const char *s, size_t len) {
+  const char *end = s + len, *q;
+  size_t n;
+
+  buf_write(b, '/');
+
+  while (s < end) {
+    for (q = s; q < end && *q != '~' && *q != '/' && *q != '\\'; q++);
+    buf_append(b, s, q - s);
+    if (q == end) break;
+
+    if (*q == '~') {
+      buf_append(b, "~0", 2);
+      s = q + 1;
+    } else if (*q == '/' || (q + 1 < end && q[1] == '/')) {
+      buf_append(b, "~1", 2);
+      s = q + (*q == '/' ? 1 : 2);
+    } else {
+      n = (q + 1 < end) ? 2 : 1;
+      buf_append(b, q, n);
+      s = q + n;
+    }
+  }
+}
+
+static void print_path(jt_t *jt) {
+  Buffer *path = jt->path;
+
+  if (jt->opt_csv) {
+    buf_write(jt->buf, '\"');
+    js_unescape_string(jt->buf, path->buf, path->pos, 1);
+    buf_write(jt->buf, '\"');
+  } else {
+    buf_append(jt->buf, path->buf, path->pos);
+  }
+}
+
+static void flatten(jt_t *jt, size_t t, size_t idx) {
+  jsparser_t *p = jt->p;
+  jstok_t *tok = js_tok(p, t);
+  size_t v, pos = (jt->path)->pos;
+  char digitbuf[24];
+  char sep = jt->opt_csv ? ',' : '\t';
+
+  if (jt->halt) return;
+
+  if (!js_is_collection(tok) || js_is_empty(tok)) {
+    if (jt->opt_source) print_source(jt);
+    print_tok(jt, idx);
+    buf_write(jt->buf, sep);
+    print_path(jt);
+    buf_write(jt->buf, sep);
+    print_tok(jt, t);
+    emit_row(jt);
+    return;
+  }
+
+  for (v = tok->first_child; v && !jt->halt; v = js_tok(p, v)->next_sibling) {
+    if (js_is_pair(js_tok(p, v))) {
+      append_key(jt->path, js_buf(p, v), js_len(p, v));
+    } else {
+      snprintf(digitbuf, sizeof(digitbuf), "/%zu", js_tok(p, v)->idx);
+      buf_append(jt->path, digitbuf, strlen(digitbuf));
+    }
+    flatten(jt, js_tok(p, v)->first_child, idx);
+    (jt->path)->pos = pos;
+  }
+}
+
+void jt_run(jt_t *jt, jsparser_t *p, size_t root, size_t idx) {
+  jt->p = p;
+  jt->gen++;
+
+  stack_push(jt->IDX, idx);
+  stack_push(jt->DAT, root);
+
+  if (jt->opt_flatten) flatten(jt, root, idx);
+  else run(jt, jt->wordc, jt->wordv, 0);
+
+  stack_pop_to(jt->DAT, -1);
+  stack_pop_to(jt->OUT, -1);
+  stack_pop_to(jt->SUB, -1);
+  stack_pop_to(jt->IDX, -1);
+}
+
+/*
+ * batches
+ *****************************************************************************/
+
+// A batchable query (see check_batch()) is run on a batch of forms one command
+// at a time. Each lookup fills a column with the value it finds in each form,
+// and the keys of a group are found for all of the forms in a row, so the same
+// few tokens and keys are compared over and over. A form whose rows can't be
+// worked out this way, because the query would iterate over one of its arrays
+// other than at a `%` that can do it, is left to run() (JT_RERUN). Rows are
+// printed by batch_row(), in the same order as the forms.
+
+#define JT_ROW   0
+#define JT_NOROW 1
+#define JT_RERUN 2
+
+// An array can be iterated over at a `%` if it has items and none of them are
+// arrays, which would be iterated over in turn.
+
+static int flat_array(jsparser_t *p, size_t a) {
+  size_t v = js_tok(p, a)->first_child;
+
+  if (!v) return 0;
+
+  for (; v; v = js_tok(p, v)->next_sibling)
+    if (js_is_array(js_tok(p, js_tok(p, v)->first_child))) return 0;
+
+  return 1;
+}
+
+static void run_batch(jt_t *jt, jsparser_t *p, size_t n, const size_t *roots) {
+  int i, j, k, m, group, memb[jt->wordc + 1];
+  size_t r, d, *src, *col = jt->colv;
+  jtword_t *w = jt->wordv;
+  jtgroup_t *g;
+
+  jt->p = p;
+  jt->gen++;
+  jt->batchc = n;
+  memcpy(col, roots, sizeof(size_t) * n);
+  memset(jt->skipv, JT_ROW, n);
+
+  for (i = 0; i < jt->wordc; i++) {
+    src = col + jt->srcv[i] * n;
+
+    // The `]` after a `%` that iterates sees the items, which were checked.
+    if (!jt->opt_iter && !(i && jt->eachv[i - 1]))
+      for (r = 0; r < n; r++)
+        if (src[r] && js_is_array(js_tok(p, src[r]))
+            && !(jt->eachv[i] && flat_array(p, src[r])))
+          jt->skipv[r] = JT_RERUN;
+
+    if (w[i].cmd != '\0') continue;
+
+    // The lookups of a group all have the same source, and they're all done
+    // when the group's first one comes up.
+    group = w[i].group;
+    for (j = 0; j < i && (group < 0 || w[j].cmd != '\0' || w[j].group != group); j++);
+    if (j < i) continue;
+
+    for (m = 0, j = i; j < jt->wordc; j++)
+      if (j == i || (group >= 0 && w[j].cmd == '\0' && w[j].group == group)) memb[m++] = j;
+
+    g = (group >= 0) ? jt->groupv + group : NULL;
+
+    for (r = 0; r < n; r++) {
+      d = src[r];
+      if (g && d && js_is_object(js_tok(p, d))) {
+        resolve_group(jt, g, d);
+        for (k = 0; k < m; k++)
+          col[(memb[k] + 1) * n + r] = g->vals[w[memb[k]].slot];
+      } else {
+        for (k = 0; k < m; k++)
+          col[(memb[k] + 1) * n + r] = get(jt, w + memb[k], d);
+      }
+    }
+  }
+
+  // With -j a lookup that finds nothing cuts off the rows.
+  for (i = 0; jt->opt_join && i < jt->wordc; i++)
+    if (w[i].cmd == '\0')
+      for (r = 0, src = col + (i + 1) * n; r < n; r++)
+        if (!src[r] && jt->skipv[r] == JT_ROW) jt->skipv[r] = JT_NOROW;
+}
+
+// Prints the rows of form r in the batch, or runs the query on it. Each `%`
+// that iterates over an array prints one of its items (itrv[i]), and a `^`
+// after it prints the item's index, as run_each() would. The items are
+// stepped through like the digits of an odometer, the last `%` fastest.
+
+static void batch_row(jt_t *jt, jsparser_t *p, size_t root, size_t idx, size_t r) {
+  size_t n = jt->batchc, itrv[jt->wordc + 1], a, itr;
+  int i;
+
+  if (jt->skipv[r] == JT_RERUN) {
+    jt_run(jt, p, root, idx);
+    return;
+  }
+
+  if (jt->halt || jt->skipv[r] == JT_NOROW) return;
+
+  jt->p = p;
+
+  for (i = 0; i < jt->wordc; i++) {
+    a = jt->colv[jt->srcv[i] * n + r];
+    itrv[i] = (jt->eachv[i] && !jt->opt_iter && a && js_is_array(js_tok(p, a)))
+      ? js_tok(p, a)->first_child : 0;
+  }
+
+  do {
+    for (itr = idx, i = 0; i < jt->wordc; i++) {
+      if (itrv[i]) itr = itrv[i];
+      if (jt->wordv[i].cmd == '^')
+        stack_push(jt->OUT, itr);
+      else if (jt->wordv[i].cmd == '%')
+        stack_push(jt->OUT, itrv[i] ? js_tok(p, itrv[i])->first_child
+                                    : jt->colv[jt->srcv[i] * n + r]);
+    }
+
+    print_row(jt, (jt->OUT)->head + 1);
+    stack_pop_to(jt->OUT, -1);
+
+    for (i = jt->wordc - 1; i >= 0; i--) {
+      if (!itrv[i]) continue;
+      if ((itrv[i] = js_tok(p, itrv[i])->next_sibling)) break;
+      itrv[i] = js_tok(p, jt->colv[jt->srcv[i] * n + r])->first_child;
+    }
+  } while (i >= 0 && !jt->halt);
+}
+
+// Runs each of the queries on a form that was just parsed, and returns
+// whether every query has halted. Queries that are running a batch print the
+// form's rows from it, the form being the batch's r-th.
+
+static int run_form(jt_t **jtv, int jtc, jsparser_t *p, size_t root, size_t idx, size_t r) {
+  size_t bpos, ppos;
+  int i, more, halt = 1;
+  FILE *in;
+
+  // The input buffer now looks something like this:
+  //
+  //    [XXXXXXYYYY--------]
+  //           ^   ^
+  //           pp  bp
+  //
+  // where the Xs are the bytes in the current JSON object just read from
+  // stdin, the Ys are more bytes read from stdin but which are not part of
+  // the current JSON object and have not yet been parsed. The pp and bp
+  // pointers point to the end of the parsed input and the end of bytes read
+  // from stdin. The minuses indicate bytes in the input buffer than have
+  // been allocated but are not being used at the moment.
+  //
+  // The + command parses nested JSON (JSON embedded in strings, xzibit style).
+  // For this to work we need space in the input buffer to write out the JSON
+  // unescaped contents of those strings. We use the end of the input buffer
+  // for this purpose, by moving pp to coincide with bp:
+  //
+  //    [XXXXXXYYYY--------]
+  //               ^
+  //               pp
+  //               bp
+  //
+  // Now if the + command needs to parse some JSON it writes the unescaped
+  // string contents to the input buffer:
+  //
+  //    [XXXXXXYYYYZZZZZ---]
+  //               ^    ^
+  //               pp   bp
+  //
+  // And then parses it:
+  //
+  //    [XXXXXXYYYYZZZZZ---]
+  //                    ^
+  //                    bp
+  //                    pp
+  //
+  // Additionally, we detach the parser from its input stream to prevent it
+  // from reading any bytes from stdin into the scratch space at the end of
+  // the input buffer that we're using for the nested JSON. A situation like
+  // this would be difficult to manage:
+  //
+  //    [XXXXXXYYYYZZZZZYYYZZZZYY----]
+  //
+  // When all the commands have finished executing for the current JSON
+  // object (i.e. the XXXXXX bytes) we must restore the input buffer pointers
+  // to their original states:
+  //
+  //    [XXXXXXYYYYZZZZZ---]
+  //           ^   ^
+  //           pp  bp
+  //
+  // This way we continue parsing from where we left off, and the Zs get
+  // overwritten by bytes read from stdin (more Ys).
+
+  bpos = (p->js)->pos;
+  ppos = p->pos;
+  in = p->in;
+  more = p->more;
+  p->pos = bpos;
+  p->in = NULL;
+  p->more = 0;
+
+  for (i = 0; i < jtc; i++) {
+    if (jtv[i]->batchc) batch_row(jtv[i], p, root, idx, r);
+    else jt_run(jtv[i], p, root, idx);
+    halt = halt && jtv[i]->halt;
+  }
+
+  // Restore parser to the saved state.
+  (p->js)->pos = bpos;
+  p->pos = ppos;
+  p->in = in;
+  p->more = more;
+
+  return halt && jtc > 0;
+}
+
+// The parser can scan the forms for a key if all of the queries search for it.
+
+static const char *scan_key(jt_t **jtv, int jtc) {
+  int i;
+
+  for (i = 0; i < jtc; i++)
+    if (!jtv[i]->scan || strcmp(jtv[i]->scan, jtv[0]->scan)) return NULL;
+
+  return jtc > 0 ? jtv[0]->scan : NULL;
+}
+
+static int halted(jt_t **jtv, int jtc) {
+  int i, halt = jtc > 0;
+
+  for (i = 0; i < jtc; i++)
+    halt = halt && jtv[i]->halt;
+
+  return halt;
+}
+
+// Parses JSON forms from p and runs each of the queries on them, until there
+// are no more complete forms. Returns JS_EDONE at the end of the input (or
+// when every query has stopped early), JS_EMORE when a parser that is fed from
+// memory needs more input, or the parse error.
+
+jserr_t jt_exec(jt_t **jtv, int jtc, jsparser_t *p) {
+  int halt = halted(jtv, jtc);
+  jserr_t err = 0;
+  size_t root;
+
+  p->scan = scan_key(jtv, jtc);
+
+  while (!halt && !(err = js_parse_one_parallel(p, &root, p->threads))) {
+    halt = run_form(jtv, jtc, p, root, js_create_index(p, p->forms++), 0);
+    js_reset(p);
+  }
+
+  return halt ? JS_EDONE : err;
+}
+
+// In pipelined mode a thread parses forms into arenas and passes them through
+// a ring to the calling thread, which runs the queries on them and passes the
+// arenas back through another ring to be reused. The parser thread stops
+// after it sends a record with an error (JS_EDONE at the end of the input).
+// When every query has halted the calling thread asks it to stop, and then
+// drains the ring up to that last record.
+
+typedef struct {
+  jsarena_t arena;
+  size_t root;
+  size_t form;
+  jserr_t err;
+} jtrecord_t;
+
+typedef struct {
+  jsparser_t *p;
+  Ring *full;
+  Ring *free;
+  int stop;
+} jtpipe_t;
+
+static void *parse_loop(void *arg) {
+  jtpipe_t *pl = arg;
+  jsparser_t *p = pl->p;
+  jtrecord_t *r;
+  jserr_t err;
+
+  do {
+    r = ring_pop(pl->free);
+    if (__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE)) {
+      r->err = JS_EDONE;
+    } else if (!(r->err = js_parse_one_parallel(p, &r->root, p->threads))) {
+      r->form = p->forms++;
+      js_take(p, &r->arena);
+    }
+    err = r->err;
+    ring_push(pl->full, r);
+  } while (!err);
+
+  return NULL;
+}
+
+// Same as jt_exec(), but parsing and running the queries overlap. The parser
+// is left where jt_exec() would leave it, except when the queries halted.
+
+jserr_t jt_exec_pipelined(jt_t **jtv, int jtc, jsparser_t *p) {
+  jtrecord_t recs[JT_PIPEDEPTH], *r;
+  jtpipe_t pl = {p, NULL, NULL, 0};
+  int i, halt = halted(jtv, jtc);
+  jsparser_t q = *p;
+  pthread_t thread;
+  jsarena_t own;
+  jserr_t err;
+
+  if (halt) return JS_EDONE;
+
+  p->scan = scan_key(jtv, jtc);
+
+  // The queries run on a parser of their own, detached from the input.
+  q.in = NULL;
+  q.reader = NULL;
+  q.more = 0;
+  js_arena_alloc(&own);
+  js_swap(&q, &own);
+
+  ring_alloc(&pl.full, JT_PIPEDEPTH);
+  ring_alloc(&pl.free, JT_PIPEDEPTH);
+
+  for (i = 0; i < JT_PIPEDEPTH; i++) {
+    js_arena_alloc(&recs[i].arena);
+    ring_push(pl.free, recs + i);
+  }
+
+  if (pthread_create(&thread, NULL, parse_loop, &pl))
+    die_err("can't create thread");
+
+  while (!(err = (r = ring_pop(pl.full))->err)) {
+    if (!halt) {
+      js_swap(&q, &r->arena);
+      halt = run_form(jtv, jtc, &q, r->root, js_create_index(&q, r->form), 0);
+      js_swap(&q, &r->arena);
+      if (halt) __atomic_store_n(&pl.stop, 1, __ATOMIC_RELEASE);
+    }
+    ring_push(pl.free, r);
+  }
+
+  pthread_join(thread, NULL);
+
+  for (i = 0; i < JT_PIPEDEPTH; i++)
+    js_arena_free(&recs[i].arena);
+  ring_free(&pl.full);
+  ring_free(&pl.free);
+  js_swap(&q, &own);
+  js_arena_free(&own);
+
+  return halt ? JS_EDONE : err;
+}
+
+// Same as jt_exec(), but up to n forms are parsed before any of them are run,
+// without resetting the parser in between, and the batchable queries are run
+// on all of them at once (see run_batch()). The rows are printed in the same
+// order. After an error the forms parsed before it are run, and the parser is
+// left where the error was found.
+
+jserr_t jt_exec_batched(jt_t **jtv, int jtc, jsparser_t *p, size_t n) {
+  size_t *roots = jmalloc(sizeof(size_t) * n), *idxs = jmalloc(sizeof(size_t) * n), k, r;
+  int i, halt = halted(jtv, jtc);
+  jserr_t err = 0;
+
+  p->scan = scan_key(jtv, jtc);
+
+  for (i = 0; i < jtc; i++) {
+    if (!jtv[i]->srcv) continue;
+    jtv[i]->colv = jmalloc(sizeof(size_t) * (jtv[i]->wordc + 1) * n);
+    jtv[i]->skipv = jmalloc(n);
+  }
+
+  while (!halt && !err) {
+    for (k = 0; k < n && (!k || p->pos < JT_BATCHBYTES)
+                && !(err = js_parse_one_parallel(p, roots + k, p->threads)); k++)
+      idxs[k] = js_create_index(p, p->forms++);
+
+    for (i = 0; k && i < jtc; i++)
+      if (jtv[i]->srcv && !jtv[i]->halt) run_batch(jtv[i], p, k, roots);
+
+    for (r = 0; r < k && !halt; r++)
+      halt = run_form(jtv, jtc, p, roots[r], idxs[r], r);
+
+    for (i = 0; i < jtc; i++)
+      jtv[i]->batchc = 0;
+
+    if (!err) js_reset(p);
+  }
+
+  for (i = 0; i < jtc; i++) {
+    free(jtv[i]->colv);
+    free(jtv[i]->skipv);
+    jtv[i]->colv = NULL;
+    jtv[i]->skipv = NULL;
+  }
+
+  free(roots);
+  free(idxs);
+
+  return halt ? JS_EDONE : err;
+}
+
+/*
+ * queries
+ *****************************************************************************/
+
+// A query can't be run if a `**` isn't followed by a key, or if a `]` has no
+// `[` to match. Such a query is rejected before anything is allocated, and
+// the error is returned to the caller (see jt_error()).
+
+static jterr_t check_commands(int argc, char *argv[]) {
+  int i, subc = 0;
+
+  for (i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "**")) {
+      if (++i == argc) return JT_EKEY;
+    } else if (!strcmp(argv[i], "[")) {
+      subc++;
+    } else if (!strcmp(argv[i], "]") && !subc--) {
+      return JT_EBRACKET;
+    }
+  }
+
+  return JT_OKAY;
+}
+
+const char *jt_error(jterr_t err) {
+  switch (err) {
+    case JT_EKEY:     return "missing key after **";
+    case JT_EBRACKET: return "unmatched ]";
+    default:          return "no error";
+  }
+}
+
+jterr_t jt_alloc(jt_t **jt, int argc, char *argv[], int flags, jtrow_t row, void *ctx) {
+  jterr_t err;
+
+  if ((err = check_commands(argc, argv))) {
+    *jt = NULL;
+    return err;
+  }
+
+  *jt = jmalloc(sizeof(jt_t));
+  (*jt)->opt_join = !!(flags & JT_JOIN);
+  (*jt)->opt_iter = !!(flags & JT_ITER);
+  (*jt)->opt_csv  = !!(flags & JT_CSV);
+  (*jt)->opt_source = !!(flags & JT_SOURCE);
+  (*jt)->opt_flatten = !!(flags & JT_FLATTEN);
+  (*jt)->source = NULL;
+  (*jt)->rows = 0;
+  (*jt)->limit = 0;
+  (*jt)->halt = 0;
+  (*jt)->p    = NULL;
+  (*jt)->row  = row;
+  (*jt)->ctx  = ctx;
+  (*jt)->cols = NULL;
+  (*jt)->cols_ctx = NULL;
+  (*jt)->groupc = 0;
+  (*jt)->groupv = NULL;
+  (*jt)->gen = 0;
+  (*jt)->colv = NULL;
+  (*jt)->skipv = NULL;
+  (*jt)->batchc = 0;
+
+  buf_alloc(&((*jt)->buf));
+  buf_alloc(&((*jt)->path));
+
+  stack_alloc(&((*jt)->DAT), "data",   JT_STACKSIZE);
+  stack_alloc(&((*jt)->OUT), "output", JT_STACKSIZE);
+  stack_alloc(&((*jt)->SUB), "gosub",  JT_STACKSIZE);
+  stack_alloc(&((*jt)->IDX), "index",  JT_STACKSIZE);
+
+  parse_commands(*jt, argc, argv);
+  group_lookups(*jt);
+  check_scan(*jt);
+  check_batch(*jt);
+
+  return JT_OKAY;
+}
+
+void jt_free(jt_t **jt) {
+  if ((*jt)->header) buf_free(&((*jt)->header));
+  buf_free(&((*jt)->buf));
+  buf_free(&((*jt)->path));
+  stack_free(&((*jt)->DAT));
+  stack_free(&((*jt)->OUT));
+  stack_free(&((*jt)->SUB));
+  stack_free(&((*jt)->IDX));
+  for (int i = 0; i < (*jt)->groupc; i++) {
+    free((*jt)->groupv[i].keyv);
+    free((*jt)->groupv[i].lenv);
+    free((*jt)->groupv[i].next);
+    free((*jt)->groupv[i].vals);
+  }
+  free((*jt)->groupv);
+  free((*jt)->srcv);
+  free((*jt)->eachv);
+  free((*jt)->wordv);
+  free((*jt)->words);
+  free(*jt);
+  *jt = NULL;
+}
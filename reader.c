@@ -0,0 +1,157 @@
+/*
+ * background reader
+ *****************************************************************************/
+
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "reader.h"
+#include "util.h"
+
+// A thread reads the input stream into a ring of chunks while the parser works
+// on the chunks already read. The reader fills the slot at head and the parser
+// drains the slot at tail; the ring is full when head is READER_SLOTS ahead of
+// tail. Chunks are large, so the lock is taken rarely. A chunk with a length
+// of zero marks the end of the input, and a negative length a read error.
+
+static void reader_unlock(void *arg) {
+  pthread_mutex_unlock(arg);
+}
+
+// When following a file (see reader_alloc()) its end is not the end of the
+// input: the reader checks every READER_POLLMS milliseconds whether it has
+// grown. A file that was truncated is read again from the start. When another
+// file has taken its name (the log was rotated) that one is opened, but only
+// once the old one has been read to the end.
+
+static int reader_reopen(Reader *r) {
+  struct stat cur, st;
+  int fd;
+
+  if (stat(r->follow, &st) || fstat(r->fd, &cur)) return 0;
+
+  if (st.st_dev != cur.st_dev || st.st_ino != cur.st_ino) {
+    if ((fd = open(r->follow, O_RDONLY)) < 0) return 0;
+    if (r->reopened) close(r->fd);
+    r->fd = fd;
+    r->reopened = 1;
+    return 1;
+  }
+
+  if (st.st_size < lseek(r->fd, 0, SEEK_CUR)) {
+    lseek(r->fd, 0, SEEK_SET);
+    return 1;
+  }
+
+  return 0;
+}
+
+static ssize_t reader_fill(Reader *r, char *buf) {
+  struct timespec poll = { 0, READER_POLLMS * 1000000L };
+  ssize_t len;
+
+  while (1) {
+    while ((len = read(r->fd, buf, READER_CHUNK)) < 0 && errno == EINTR);
+    if (len || !r->follow) return len;
+    if (!reader_reopen(r)) nanosleep(&poll, NULL);
+  }
+}
+
+static void *reader_loop(void *arg) {
+  Reader *r = arg;
+  Chunk *c;
+  ssize_t len;
+
+  do {
+    // The thread may be cancelled while it waits, see reader_free().
+    pthread_mutex_lock(&r->lock);
+    pthread_cleanup_push(reader_unlock, &r->lock);
+    while (r->head - r->tail == READER_SLOTS)
+      pthread_cond_wait(&r->drained, &r->lock);
+    c = r->slots + r->head % READER_SLOTS;
+    pthread_cleanup_pop(1);
+
+    len = reader_fill(r, c->buf);
+
+    pthread_mutex_lock(&r->lock);
+    c->len = len;
+    r->head++;
+    pthread_cond_signal(&r->filled);
+    pthread_mutex_unlock(&r->lock);
+  } while (len > 0);
+
+  return NULL;
+}
+
+// Appends the next chunk of input to the buffer and returns its length, or
+// zero at the end of the input.
+
+ssize_t reader_read(Reader *r, Buffer *b) {
+  Chunk *c;
+  ssize_t len;
+
+  if (r->done) return 0;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->head == r->tail)
+    pthread_cond_wait(&r->filled, &r->lock);
+  c = r->slots + r->tail % READER_SLOTS;
+  pthread_mutex_unlock(&r->lock);
+
+  if ((len = c->len) < 0) die_err("can't read input");
+  if (len > 0) buf_append(b, c->buf, len);
+  else r->done = 1;
+
+  pthread_mutex_lock(&r->lock);
+  r->tail++;
+  pthread_cond_signal(&r->drained);
+  pthread_mutex_unlock(&r->lock);
+
+  return len;
+}
+
+// Reads the input stream, or follows the file named follow (if it's not NULL)
+// that the stream was opened from, like `tail -F`.
+
+void reader_alloc(Reader **r, FILE *in, const char *follow) {
+  int i;
+
+  *r = jmalloc(sizeof(Reader));
+
+  if (((*r)->fd = fileno(in)) == -1) die_err("bad input stream");
+
+  for (i = 0; i < READER_SLOTS; i++)
+    (*r)->slots[i].buf = jmalloc(READER_CHUNK);
+
+  (*r)->follow = follow;
+  (*r)->reopened = 0;
+  (*r)->head = 0;
+  (*r)->tail = 0;
+  (*r)->done = 0;
+
+  pthread_mutex_init(&(*r)->lock, NULL);
+  pthread_cond_init(&(*r)->filled, NULL);
+  pthread_cond_init(&(*r)->drained, NULL);
+
+  if (pthread_create(&(*r)->thread, NULL, reader_loop, *r))
+    die_err("can't create thread");
+}
+
+void reader_free(Reader **r) {
+  int i;
+
+  pthread_cancel((*r)->thread);
+  pthread_join((*r)->thread, NULL);
+
+  if ((*r)->reopened) close((*r)->fd);
+
+  pthread_mutex_destroy(&(*r)->lock);
+  pthread_cond_destroy(&(*r)->filled);
+  pthread_cond_destroy(&(*r)->drained);
+
+  for (i = 0; i < READER_SLOTS; i++)
+    free((*r)->slots[i].buf);
+
+  free(*r);
+  *r = NULL;
+}
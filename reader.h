@@ -0,0 +1,44 @@
+/*
+ * background reader
+ *****************************************************************************/
+
+#ifndef READER_H
+#define READER_H
+
+#include <pthread.h>
+#include "buffer.h"
+#include "util.h"
+
+#define READER_SLOTS 4
+#define READER_CHUNK (1 << 18)
+
+#ifndef READER_POLLMS
+#define READER_POLLMS 100
+#endif
+
+typedef struct Chunk {
+  char *buf;
+  ssize_t len;
+} Chunk;
+
+typedef struct Reader {
+  int fd;
+  const char *follow;
+  int reopened;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+  Chunk slots[READER_SLOTS];
+  size_t head;
+  size_t tail;
+  int done;
+} Reader;
+
+ssize_t reader_read(Reader *r, Buffer *b);
+
+void reader_alloc(Reader **r, FILE *in, const char *follow);
+
+void reader_free(Reader **r);
+
+#endif
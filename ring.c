@@ -0,0 +1,86 @@
+/*
+ * single producer, single consumer queue
+ *****************************************************************************/
+
+#include <sched.h>
+#include "ring.h"
+#include "util.h"
+
+// One thread pushes items at tail and another pops them at head, so each index
+// is only written by one thread and no lock is needed to move items. The ring
+// is full when tail is size items ahead of head.
+//
+// A thread that finds the ring full (or empty) yields a few times, then goes
+// to sleep until the other thread moves its index. The sleeping flag and the
+// indexes are sequentially consistent, so either the waiting thread sees the
+// new index before it sleeps or the other thread sees the flag and wakes it.
+
+static void ring_wait(Ring *r, size_t *idx, size_t old) {
+  int i;
+
+  for (i = 0; i < RING_SPINS; i++) {
+    if (__atomic_load_n(idx, __ATOMIC_ACQUIRE) != old) return;
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&r->lock);
+  __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(idx, __ATOMIC_SEQ_CST) == old)
+    pthread_cond_wait(&r->wake, &r->lock);
+  __atomic_store_n(&r->sleeping, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_wake(Ring *r) {
+  if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+void ring_push(Ring *r, void *item) {
+  size_t tail = r->tail, head;
+
+  while (tail - (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == r->size)
+    ring_wait(r, &r->head, head);
+
+  r->items[tail & (r->size - 1)] = item;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+  ring_wake(r);
+}
+
+void *ring_pop(Ring *r) {
+  size_t head = r->head, tail;
+  void *item;
+
+  while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == head)
+    ring_wait(r, &r->tail, tail);
+
+  item = r->items[head & (r->size - 1)];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+  ring_wake(r);
+
+  return item;
+}
+
+// The size is rounded up to a power of two, so indexes can be masked.
+
+void ring_alloc(Ring **r, size_t size) {
+  *r = jmalloc(sizeof(Ring));
+  for ((*r)->size = 1; (*r)->size < size; (*r)->size <<= 1);
+  (*r)->items = jmalloc(sizeof(void *) * (*r)->size);
+  (*r)->head = 0;
+  (*r)->tail = 0;
+  (*r)->sleeping = 0;
+  pthread_mutex_init(&(*r)->lock, NULL);
+  pthread_cond_init(&(*r)->wake, NULL);
+}
+
+void ring_free(Ring **r) {
+  pthread_mutex_destroy(&(*r)->lock);
+  pthread_cond_destroy(&(*r)->wake);
+  free((*r)->items);
+  free(*r);
+  *r = NULL;
+}
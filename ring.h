@@ -0,0 +1,33 @@
+/*
+ * single producer, single consumer queue
+ *****************************************************************************/
+
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+#include "util.h"
+
+#ifndef RING_SPINS
+#define RING_SPINS 64
+#endif
+
+typedef struct Ring {
+  void **items;
+  size_t size;
+  size_t head;
+  size_t tail;
+  int sleeping;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} Ring;
+
+void ring_push(Ring *r, void *item);
+
+void *ring_pop(Ring *r);
+
+void ring_alloc(Ring **r, size_t size);
+
+void ring_free(Ring **r);
+
+#endif
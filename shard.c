@@ -0,0 +1,79 @@
+/*
+ * sharded output
+ *****************************************************************************/
+
+#include "shard.h"
+#include "table.h"
+
+// Rows are split between n output files (the shards) by the hash of one of
+// their columns, so all the rows with the same value in that column end up in
+// the same file. The column is hashed as it's printed, so a value that is
+// printed the same way always goes to the same shard. Each shard has its own
+// buffer, and gets the headings before its first row.
+
+void sharder_add(Sharder *s, const char *row, size_t len) {
+  const char *f;
+  size_t flen;
+  int i;
+
+  row_field(row, len, s->col, s->csv, &f, &flen);
+  i = hash_bytes(f, flen) % s->n;
+
+  if (!(s->rows[i]++) && s->header) {
+    fwrite((s->header)->buf, 1, (s->header)->pos, s->outs[i]);
+    fputc('\n', s->outs[i]);
+  }
+
+  fwrite(row, 1, len, s->outs[i]);
+  fputc('\n', s->outs[i]);
+}
+
+// The name of each shard is the pattern with its number (counting from zero)
+// in place of the first `%d`, or after a dot at the end if there's none.
+
+static void shard_name(Buffer *b, const char *pattern, int i) {
+  const char *d = strstr(pattern, "%d");
+  char num[16];
+
+  snprintf(num, sizeof(num), "%d", i);
+
+  buf_reset(b, 0);
+  buf_append(b, pattern, d ? (size_t) (d - pattern) : strlen(pattern));
+  if (!d) buf_write(b, '.');
+  buf_append(b, num, strlen(num));
+  if (d) buf_append(b, d + 2, strlen(d + 2));
+}
+
+void sharder_alloc(Sharder **s, const char *pattern, int n, int col, int csv, int mode) {
+  Buffer *name;
+  int i;
+
+  *s = jmalloc(sizeof(Sharder));
+  (*s)->col = col;
+  (*s)->csv = csv;
+  (*s)->n = n;
+  (*s)->header = NULL;
+  (*s)->outs = jmalloc(sizeof(FILE *) * n);
+  (*s)->rows = jmalloc(sizeof(size_t) * n);
+
+  buf_alloc(&name);
+
+  for (i = 0; i < n; i++) {
+    shard_name(name, pattern, i);
+    if (! ((*s)->outs[i] = fopen(name->buf, "w")))
+      die_err("can't open output file: %s", name->buf);
+    setvbuf((*s)->outs[i], NULL, mode, SHARD_BUFSIZE);
+    (*s)->rows[i] = 0;
+  }
+
+  buf_free(&name);
+}
+
+void sharder_free(Sharder **s) {
+  for (int i = 0; i < (*s)->n; i++)
+    if (fclose((*s)->outs[i])) die_err("can't write output file");
+  free((*s)->outs);
+  free((*s)->rows);
+  free(*s);
+  *s = NULL;
+}
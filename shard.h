@@ -0,0 +1,31 @@
+/*
+ * sharded output
+ *****************************************************************************/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>
+#include "buffer.h"
+#include "util.h"
+
+#ifndef SHARD_BUFSIZE
+#define SHARD_BUFSIZE (1 << 20)
+#endif
+
+typedef struct Sharder {
+  int col;
+  int csv;
+  int n;
+  FILE **outs;
+  size_t *rows;
+  Buffer *header;
+} Sharder;
+
+void sharder_add(Sharder *s, const char *row, size_t len);
+
+void sharder_alloc(Sharder **s, const char *pattern, int n, int col, int csv, int mode);
+
+void sharder_free(Sharder **s);
+
+#endif
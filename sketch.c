@@ -0,0 +1,252 @@
+/*
+ * approximate column statistics
+ *****************************************************************************/
+
+#include <math.h>
+#include "sketch.h"
+#include "table.h"
+#include "util.h"
+
+// Each column of output gets a sketch that summarizes the values in it using
+// a fixed amount of memory:
+//
+//   * a HyperLogLog estimate of the number of distinct values,
+//   * a KLL quantile sketch of the numeric values, and
+//   * a Space-Saving list of the most frequent values.
+//
+// Values are hashed as they appear in the JSON input (strings are not
+// unescaped), so no output is formatted.
+
+static uint64_t sketch_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+/*
+ * distinct values (HyperLogLog)
+ *****************************************************************************/
+
+static void hll_add(Sketch *s, uint64_t h) {
+  size_t i = h >> (64 - SKETCH_HLL_BITS);
+  uint8_t rank = 1;
+
+  for (h <<= SKETCH_HLL_BITS; rank <= 64 - SKETCH_HLL_BITS && !(h >> 63); h <<= 1)
+    rank++;
+
+  if (rank > s->hll[i]) s->hll[i] = rank;
+}
+
+static double hll_estimate(Sketch *s) {
+  double m = 1 << SKETCH_HLL_BITS, sum = 0, e;
+  size_t i, zeros = 0;
+
+  for (i = 0; i < (1 << SKETCH_HLL_BITS); i++) {
+    sum += ldexp(1, -s->hll[i]);
+    if (!s->hll[i]) zeros++;
+  }
+
+  e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+  if (e <= 2.5 * m && zeros) e = m * log(m / zeros);
+
+  return e;
+}
+
+/*
+ * quantiles (KLL)
+ *****************************************************************************/
+
+// Level h holds values that each stand for 2^h input values. When a level is
+// full it's sorted and every other value (starting at a random offset) is
+// promoted to the next level. Lower levels get geometrically smaller
+// capacities, so the sketch holds O(k) values in total.
+
+static size_t kll_capacity(Sketch *s, int h) {
+  double cap = SKETCH_KLL_K * pow(2.0 / 3.0, s->kll_levels - 1 - h);
+  return cap < 2 ? 2 : (size_t) ceil(cap);
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void kll_add_level(Sketch *s) {
+  if (s->kll_levels == SKETCH_KLL_LEVELS) die("quantile sketch is full");
+  s->kll[s->kll_levels] = jmalloc(sizeof(double) * (SKETCH_KLL_K + 1) * 2);
+  s->kll_lens[s->kll_levels++] = 0;
+}
+
+static void kll_compact(Sketch *s, int h) {
+  size_t i, n = s->kll_lens[h];
+  double *v = s->kll[h];
+
+  if (h + 1 == s->kll_levels) kll_add_level(s);
+
+  qsort(v, n, sizeof(double), cmp_double);
+
+  s->seed = s->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+  for (i = (s->seed >> 63); i < n - (n & 1); i += 2)
+    s->kll[h + 1][s->kll_lens[h + 1]++] = v[i];
+
+  // With an odd number of values the largest one stays behind.
+  if (n & 1) v[0] = v[n - 1];
+  s->kll_lens[h] = n & 1;
+}
+
+static void kll_add(Sketch *s, double x) {
+  int h;
+
+  if (!s->kll_levels) kll_add_level(s);
+
+  s->kll[0][s->kll_lens[0]++] = x;
+
+  for (h = 0; h < s->kll_levels; h++)
+    if (s->kll_lens[h] >= kll_capacity(s, h)) kll_compact(s, h);
+}
+
+typedef struct {
+  double val;
+  size_t weight;
+} kllitem_t;
+
+static int cmp_kllitem(const void *a, const void *b) {
+  return cmp_double(&((const kllitem_t *) a)->val, &((const kllitem_t *) b)->val);
+}
+
+static void kll_quantiles(Sketch *s, const double *qs, double *out, int nq) {
+  size_t i, n = 0, total = 0, sum = 0;
+  kllitem_t *items;
+  int h, q = 0;
+
+  for (h = 0; h < s->kll_levels; h++) n += s->kll_lens[h];
+
+  items = jmalloc(sizeof(kllitem_t) * (n ? n : 1));
+
+  for (n = 0, h = 0; h < s->kll_levels; h++) {
+    for (i = 0; i < s->kll_lens[h]; i++) {
+      items[n].val = s->kll[h][i];
+      items[n++].weight = (size_t) 1 << h;
+      total += (size_t) 1 << h;
+    }
+  }
+
+  qsort(items, n, sizeof(kllitem_t), cmp_kllitem);
+
+  for (i = 0; i < n && q < nq; i++) {
+    sum += items[i].weight;
+    while (q < nq && sum >= qs[q] * total) out[q++] = items[i].val;
+  }
+
+  while (q < nq) out[q++] = n ? items[n - 1].val : 0;
+
+  free(items);
+}
+
+/*
+ * frequent values (Space-Saving)
+ *****************************************************************************/
+
+// When a value that isn't being counted comes along and all the counters are
+// in use, the counter with the smallest count is taken over by the new value.
+// Its old count becomes the new value's error bound.
+
+static void top_add(Sketch *s, uint64_t h, const char *val, size_t len) {
+  Counter *c;
+  int i, min = 0;
+
+  for (i = 0; i < s->top_count; i++) {
+    if (s->top_hashes[i] == h) {
+      s->top[i].count++;
+      return;
+    }
+  }
+
+  if (s->top_count < SKETCH_TOP_SLOTS) {
+    i = s->top_count++;
+    s->top[i].count = s->top[i].err = 0;
+  } else {
+    for (i = 1; i < SKETCH_TOP_SLOTS; i++)
+      if (s->top[i].count < s->top[min].count) min = i;
+    i = min;
+    s->top[i].err = s->top[i].count;
+  }
+
+  c = s->top + i;
+  s->top_hashes[i] = h;
+  c->count++;
+  c->len = len < SKETCH_VALUE_MAX ? len : SKETCH_VALUE_MAX;
+  memcpy(c->val, val, c->len);
+}
+
+static int cmp_counter(const void *a, const void *b) {
+  size_t x = ((const Counter *) a)->count, y = ((const Counter *) b)->count;
+  return (x < y) - (x > y);
+}
+
+/*
+ * sketches
+ *****************************************************************************/
+
+void sketch_add(Sketch *s, const char *val, size_t len, int number, double x) {
+  uint64_t h = sketch_mix(hash_bytes(val, len));
+
+  s->count++;
+  hll_add(s, h);
+  top_add(s, h, val, len);
+
+  if (number) {
+    if (!s->numbers++ || x < s->min) s->min = x;
+    if (s->numbers == 1 || x > s->max) s->max = x;
+    kll_add(s, x);
+  }
+}
+
+// The summary is printed as rows of tab separated values: the column name,
+// the name of the statistic, and its value. Frequent values are followed by
+// their count, which is overestimated by at most the error shown after it.
+
+void sketch_print(Sketch *s, const char *name, FILE *out) {
+  static const double qs[] = {0.25, 0.5, 0.75, 0.9, 0.99};
+  static const char *qnames[] = {"p25", "p50", "p75", "p90", "p99"};
+  Counter top[SKETCH_TOP_SLOTS];
+  double qv[5];
+  int i;
+
+  fprintf(out, "%s\tcount\t%zu\n", name, s->count);
+  fprintf(out, "%s\tdistinct\t%.0f\n", name, round(hll_estimate(s)));
+
+  if (s->numbers) {
+    kll_quantiles(s, qs, qv, 5);
+    fprintf(out, "%s\tnumbers\t%zu\n", name, s->numbers);
+    fprintf(out, "%s\tmin\t%.15g\n", name, s->min);
+    for (i = 0; i < 5; i++)
+      fprintf(out, "%s\t%s\t%.15g\n", name, qnames[i], qv[i]);
+    fprintf(out, "%s\tmax\t%.15g\n", name, s->max);
+  }
+
+  memcpy(top, s->top, sizeof(Counter) * s->top_count);
+  qsort(top, s->top_count, sizeof(Counter), cmp_counter);
+
+  for (i = 0; i < s->top_count && i < SKETCH_TOP_SHOW; i++)
+    fprintf(out, "%s\ttop\t%.*s\t%zu\t%zu\n", name,
+            (int) top[i].len, top[i].val, top[i].count, top[i].err);
+}
+
+void sketch_alloc(Sketch **s) {
+  *s = jmalloc(sizeof(Sketch));
+  memset(*s, 0, sizeof(Sketch));
+  (*s)->seed = 0x853c49e6748fea9bULL;
+}
+
+void sketch_free(Sketch **s) {
+  int h;
+  for (h = 0; h < (*s)->kll_levels; h++)
+    free((*s)->kll[h]);
+  free(*s);
+  *s = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * approximate column statistics
+ *****************************************************************************/
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "util.h"
+
+#define SKETCH_HLL_BITS   12
+#define SKETCH_KLL_K      200
+#define SKETCH_KLL_LEVELS 48
+#define SKETCH_TOP_SLOTS  64
+#define SKETCH_TOP_SHOW   10
+#define SKETCH_VALUE_MAX  120
+
+typedef struct Counter {
+  size_t count;
+  size_t err;
+  size_t len;
+  char val[SKETCH_VALUE_MAX];
+} Counter;
+
+typedef struct Sketch {
+  size_t count;
+  size_t numbers;
+  double min;
+  double max;
+  uint8_t hll[1 << SKETCH_HLL_BITS];
+  double *kll[SKETCH_KLL_LEVELS];
+  size_t kll_lens[SKETCH_KLL_LEVELS];
+  int kll_levels;
+  uint64_t seed;
+  uint64_t top_hashes[SKETCH_TOP_SLOTS];
+  Counter top[SKETCH_TOP_SLOTS];
+  int top_count;
+} Sketch;
+
+void sketch_add(Sketch *s, const char *val, size_t len, int number, double x);
+
+void sketch_print(Sketch *s, const char *name, FILE *out);
+
+void sketch_alloc(Sketch **s);
+
+void sketch_free(Sketch **s);
+
+#endif
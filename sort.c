@@ -0,0 +1,342 @@
+/*
+ * sorted output
+ *****************************************************************************/
+
+#include <math.h>
+#include "sort.h"
+
+// Rows are sorted on one or more of their columns (the keys), each compared
+// as text or as a number. Rows are collected in an arena until the memory
+// budget is used up, then sorted and written to a temporary file (a run). At
+// the end the runs and the rows still in memory are merged. The sort is
+// stable: rows with equal keys are written in the order they were added.
+//
+// Each row carries its first key in a form that's cheap to compare: the value
+// of a numeric key, or the first eight bytes of a text key as a big-endian
+// integer. Most comparisons are settled by it without touching the row.
+
+/*
+ * keys
+ *****************************************************************************/
+
+// Text is compared byte by byte, reading a doubled quote in CSV as one.
+
+static int cmp_text(const char *a, size_t alen, const char *b, size_t blen, int csv) {
+  size_t i = 0, j = 0, step;
+  int c;
+
+  if (!csv) {
+    c = memcmp(a, b, alen < blen ? alen : blen);
+    return c ? c : (alen > blen) - (alen < blen);
+  }
+
+  while (i < alen && j < blen) {
+    if (a[i] != b[j]) return (unsigned char) a[i] - (unsigned char) b[j];
+    step = (a[i] == '\"') ? 2 : 1;
+    i += step;
+    j += step;
+  }
+
+  return (i < alen) - (j < blen);
+}
+
+static uint64_t text_prefix(const char *s, size_t len, int csv) {
+  uint64_t x = 0;
+  size_t i;
+  int n;
+
+  for (i = 0, n = 0; i < len && n < 8; i += (csv && s[i] == '\"') ? 2 : 1, n++)
+    x |= (uint64_t) (unsigned char) s[i] << (56 - 8 * n);
+
+  return x;
+}
+
+// Fields that aren't numbers sort before all numbers.
+
+static double field_num(const char *s, size_t len) {
+  char tmp[64], *end;
+  double x;
+
+  if (!len || len >= sizeof(tmp)) return NAN;
+
+  memcpy(tmp, s, len);
+  tmp[len] = '\0';
+  x = strtod(tmp, &end);
+
+  return (end == tmp + len) ? x : NAN;
+}
+
+static int cmp_num(double x, double y) {
+  if (isnan(x) || isnan(y)) return !isnan(x) - !isnan(y);
+  return (x > y) - (x < y);
+}
+
+static void row_keys(Sorter *s, const char *row, SortRow *r) {
+  const char *f;
+  size_t len;
+
+  row_field(row, r->len, s->keys[0].col, s->csv, &f, &len);
+
+  if (s->keys[0].numeric) r->num = field_num(f, len);
+  else r->prefix = text_prefix(f, len, s->csv);
+}
+
+static int cmp_rows(Sorter *s, const char *a, const SortRow *ra,
+                    const char *b, const SortRow *rb) {
+  const char *fa, *fb;
+  size_t la, lb;
+  int k, c;
+
+  if (s->keys[0].numeric) {
+    if ((c = cmp_num(ra->num, rb->num))) return c;
+  } else if (ra->prefix != rb->prefix) {
+    return ra->prefix < rb->prefix ? -1 : 1;
+  }
+
+  for (k = (s->keys[0].numeric ? 1 : 0); k < s->keyc; k++) {
+    row_field(a, ra->len, s->keys[k].col, s->csv, &fa, &la);
+    row_field(b, rb->len, s->keys[k].col, s->csv, &fb, &lb);
+    c = s->keys[k].numeric
+      ? cmp_num(field_num(fa, la), field_num(fb, lb))
+      : cmp_text(fa, la, fb, lb, s->csv);
+    if (c) return c;
+  }
+
+  return 0;
+}
+
+/*
+ * runs
+ *****************************************************************************/
+
+// The rows in memory are sorted with a bottom-up merge sort, which is stable
+// and reads the rows sequentially.
+
+static void sort_rows(Sorter *s) {
+  SortRow *a = s->rows, *b = s->tmp, *t;
+  const char *base = (s->arena)->buf;
+  size_t n = s->rowc, w, l, m, r, i, j, k;
+
+  for (w = 1; w < n; w *= 2) {
+    for (l = 0; l < n; l += 2 * w) {
+      m = (l + w < n) ? l + w : n;
+      r = (l + 2 * w < n) ? l + 2 * w : n;
+      for (i = l, j = m, k = l; k < r; k++) {
+        if (i < m && (j >= r || cmp_rows(s, base + a[i].off, a + i, base + a[j].off, a + j) <= 0))
+          b[k] = a[i++];
+        else
+          b[k] = a[j++];
+      }
+    }
+    t = a;
+    a = b;
+    b = t;
+  }
+
+  s->rows = a;
+  s->tmp = b;
+}
+
+// Runs are written to unnamed files in $TMPDIR (or /tmp), each row preceded
+// by its length, since rows may contain newlines.
+
+static FILE *run_file() {
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  FILE *f;
+  int fd;
+
+  if (!dir || !*dir) dir = "/tmp";
+  snprintf(path, sizeof(path), "%s/jt.XXXXXX", dir);
+
+  if ((fd = mkstemp(path)) < 0 || !(f = fdopen(fd, "w+")))
+    die_err("can't create temporary file in %s", dir);
+
+  unlink(path);
+  setvbuf(f, NULL, _IOFBF, SORT_RUNBUFSIZE);
+
+  return f;
+}
+
+static void spill(Sorter *s) {
+  FILE *run = run_file();
+  SortRow *r;
+  size_t i;
+
+  sort_rows(s);
+
+  for (i = 0; i < s->rowc; i++) {
+    r = s->rows + i;
+    fwrite(&(r->len), sizeof(size_t), 1, run);
+    fwrite((s->arena)->buf + r->off, 1, r->len, run);
+  }
+
+  if (fflush(run) || ferror(run)) die_err("can't write temporary file");
+  rewind(run);
+
+  s->runs = jrealloc(s->runs, sizeof(FILE *) * (s->runc + 1));
+  s->runs[s->runc++] = run;
+
+  s->rowc = 0;
+  buf_reset(s->arena, 0);
+}
+
+void sorter_add(Sorter *s, const char *row, size_t len) {
+  SortRow *r;
+
+  if (s->rowc && (s->arena)->pos + len + (s->rowc + 1) * 2 * sizeof(SortRow) > s->budget)
+    spill(s);
+
+  if (s->rowc == s->rows_size) {
+    s->rows_size *= 2;
+    s->rows = jrealloc(s->rows, sizeof(SortRow) * s->rows_size);
+    s->tmp = jrealloc(s->tmp, sizeof(SortRow) * s->rows_size);
+  }
+
+  r = s->rows + s->rowc++;
+  r->off = (s->arena)->pos;
+  r->len = len;
+  buf_append(s->arena, row, len);
+  row_keys(s, (s->arena)->buf + r->off, r);
+}
+
+/*
+ * merging
+ *****************************************************************************/
+
+// A cursor reads the rows of a run, or of the rows left in memory. The
+// cursors are kept in a heap ordered by their current rows, ties going to the
+// cursor with the earlier rows so the merge stays stable.
+
+typedef struct {
+  FILE *run;
+  size_t next;
+  Buffer *buf;
+  SortRow row;
+  const char *text;
+} cursor_t;
+
+static int cursor_next(Sorter *s, cursor_t *c) {
+  if (!c->run) {
+    if (c->next >= s->rowc) return 0;
+    c->row = s->rows[c->next++];
+    c->text = (s->arena)->buf + c->row.off;
+    return 1;
+  }
+
+  if (fread(&(c->row.len), sizeof(size_t), 1, c->run) != 1) return 0;
+
+  buf_reset(c->buf, 0);
+  buf_check(c->buf, c->row.len);
+  if (fread((c->buf)->buf, 1, c->row.len, c->run) != c->row.len)
+    die_err("can't read temporary file");
+
+  c->text = (c->buf)->buf;
+  c->row.off = 0;
+  row_keys(s, c->text, &(c->row));
+
+  return 1;
+}
+
+static int cursor_less(Sorter *s, cursor_t *a, cursor_t *b) {
+  int c = cmp_rows(s, a->text, &(a->row), b->text, &(b->row));
+  return c ? c < 0 : a < b;
+}
+
+static void sift_down(Sorter *s, cursor_t **heap, int n, int i) {
+  cursor_t *tmp;
+  int min, l;
+
+  for (; (l = 2 * i + 1) < n; i = min) {
+    min = (l + 1 < n && cursor_less(s, heap[l + 1], heap[l])) ? l + 1 : l;
+    if (!cursor_less(s, heap[min], heap[i])) break;
+    tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+  }
+}
+
+// Writes a row, after the headings if it's the first one. Returns zero when
+// the row limit has been reached.
+
+static int write_sorted(Sorter *s, const char *row, size_t len, size_t *n) {
+  if (!((*n)++) && s->header) {
+    fwrite((s->header)->buf, 1, (s->header)->pos, s->out);
+    fputc('\n', s->out);
+  }
+
+  fwrite(row, 1, len, s->out);
+  fputc('\n', s->out);
+
+  return !s->limit || *n < s->limit;
+}
+
+void sorter_finish(Sorter *s) {
+  cursor_t *curs, **heap;
+  size_t i, n = 0;
+  int k, c;
+
+  sort_rows(s);
+
+  if (!s->runc) {
+    for (i = 0; i < s->rowc; i++)
+      if (!write_sorted(s, (s->arena)->buf + s->rows[i].off, s->rows[i].len, &n)) break;
+    return;
+  }
+
+  curs = jmalloc(sizeof(cursor_t) * (s->runc + 1));
+  heap = jmalloc(sizeof(cursor_t *) * (s->runc + 1));
+
+  for (c = k = 0; c <= s->runc; c++) {
+    curs[c].run = (c < s->runc) ? s->runs[c] : NULL;
+    curs[c].next = 0;
+    buf_alloc(&(curs[c].buf));
+    if (cursor_next(s, curs + c)) heap[k++] = curs + c;
+  }
+
+  for (c = k / 2 - 1; c >= 0; c--)
+    sift_down(s, heap, k, c);
+
+  while (k) {
+    if (!write_sorted(s, heap[0]->text, heap[0]->row.len, &n)) break;
+    if (!cursor_next(s, heap[0])) heap[0] = heap[--k];
+    sift_down(s, heap, k, 0);
+  }
+
+  for (c = 0; c <= s->runc; c++) {
+    if (curs[c].run) fclose(curs[c].run);
+    buf_free(&(curs[c].buf));
+  }
+
+  free(curs);
+  free(heap);
+  free(s->runs);
+  s->runs = NULL;
+  s->runc = 0;
+}
+
+void sorter_alloc(Sorter **s, const SortKey *keys, int keyc, int csv, size_t budget, FILE *out) {
+  *s = jmalloc(sizeof(Sorter));
+  (*s)->keys = keys;
+  (*s)->keyc = keyc;
+  (*s)->csv = csv;
+  (*s)->budget = budget;
+  (*s)->limit = 0;
+  (*s)->header = NULL;
+  (*s)->out = out;
+  (*s)->rowc = 0;
+  (*s)->rows_size = 1024;
+  (*s)->rows = jmalloc(sizeof(SortRow) * (*s)->rows_size);
+  (*s)->tmp = jmalloc(sizeof(SortRow) * (*s)->rows_size);
+  (*s)->runs = NULL;
+  (*s)->runc = 0;
+  buf_alloc(&((*s)->arena));
+}
+
+void sorter_free(Sorter **s) {
+  buf_free(&((*s)->arena));
+  free((*s)->rows);
+  free((*s)->tmp);
+  free(*s);
+  *s = NULL;
+}
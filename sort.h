@@ -0,0 +1,52 @@
+/*
+ * sorted output
+ *****************************************************************************/
+
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "util.h"
+
+#define SORT_RUNBUFSIZE (1 << 16)
+
+typedef struct SortKey {
+  int col;
+  int numeric;
+} SortKey;
+
+typedef struct SortRow {
+  uint64_t prefix;
+  double num;
+  size_t off;
+  size_t len;
+} SortRow;
+
+typedef struct Sorter {
+  const SortKey *keys;
+  int keyc;
+  int csv;
+  size_t budget;
+  size_t limit;
+  Buffer *header;
+  FILE *out;
+  Buffer *arena;
+  SortRow *rows;
+  SortRow *tmp;
+  size_t rowc;
+  size_t rows_size;
+  FILE **runs;
+  int runc;
+} Sorter;
+
+void sorter_add(Sorter *s, const char *row, size_t len);
+
+void sorter_finish(Sorter *s);
+
+void sorter_alloc(Sorter **s, const SortKey *keys, int keyc, int csv, size_t budget, FILE *out);
+
+void sorter_free(Sorter **s);
+
+#endif
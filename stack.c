@@ -5,9 +5,12 @@
 #include "stack.h"
 #include "util.h"
 
+// A stack grows as needed, since how deep it gets depends on the input as
+// well as the query.
+
 void stack_push(Stack *stack, size_t item) {
-  if (stack->head >= stack->size)
-    die("%s stack overflow", stack->name);
+  if (stack->head + 1 >= stack->size)
+    stack->items = jrealloc(stack->items, sizeof(size_t) * (stack->size *= 2));
   (stack->items)[++(stack->head)] = item;
 }
 
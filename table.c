@@ -0,0 +1,101 @@
+/*
+ * hash tables
+ *****************************************************************************/
+
+#include "table.h"
+#include "util.h"
+
+// Keys are numbered 0, 1, 2, ... in insertion order, so callers can keep the
+// values in plain arrays indexed by key number. The slots array is an open
+// addressing table of key numbers plus one (zero marks an empty slot).
+
+uint64_t hash_bytes(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h ^ (h >> 29);
+}
+
+static size_t table_find(Table *t, const char *key, size_t len) {
+  size_t i = hash_bytes(key, len) & (t->size - 1), k;
+
+  while ((k = t->slots[i])) {
+    if (t->lens[k - 1] == len && !memcmp(table_key(t, k - 1), key, len))
+      break;
+    i = (i + 1) & (t->size - 1);
+  }
+
+  return i;
+}
+
+static void table_grow(Table *t) {
+  size_t i, k, *old = t->slots, size = t->size;
+
+  t->size *= 2;
+  t->slots = jmalloc(sizeof(size_t) * t->size);
+  memset(t->slots, 0, sizeof(size_t) * t->size);
+
+  t->offs = jrealloc(t->offs, sizeof(size_t) * t->size / 2);
+  t->lens = jrealloc(t->lens, sizeof(size_t) * t->size / 2);
+
+  for (i = 0; i < size; i++)
+    if ((k = old[i]))
+      t->slots[table_find(t, table_key(t, k - 1), t->lens[k - 1])] = k;
+
+  free(old);
+}
+
+size_t table_get(Table *t, const char *key, size_t len) {
+  size_t k = t->slots[table_find(t, key, len)];
+  return k ? k - 1 : SIZE_MAX;
+}
+
+size_t table_put(Table *t, const char *key, size_t len) {
+  size_t i = table_find(t, key, len);
+
+  if (t->slots[i]) return t->slots[i] - 1;
+
+  t->offs[t->count] = (t->keys)->pos;
+  t->lens[t->count] = len;
+  buf_append(t->keys, key, len);
+  buf_write(t->keys, '\0');
+  t->slots[i] = ++(t->count);
+
+  if (t->count * 2 >= t->size) table_grow(t);
+
+  return t->count - 1;
+}
+
+const char *table_key(Table *t, size_t i) {
+  return (t->keys)->buf + t->offs[i];
+}
+
+size_t table_len(Table *t, size_t i) {
+  return t->lens[i];
+}
+
+void table_alloc(Table **t, size_t size) {
+  size_t n = 16;
+  while (n < size * 2) n *= 2;
+
+  *t = jmalloc(sizeof(Table));
+  buf_alloc(&((*t)->keys));
+  (*t)->slots = jmalloc(sizeof(size_t) * n);
+  memset((*t)->slots, 0, sizeof(size_t) * n);
+  (*t)->offs  = jmalloc(sizeof(size_t) * n / 2);
+  (*t)->lens  = jmalloc(sizeof(size_t) * n / 2);
+  (*t)->count = 0;
+  (*t)->size  = n;
+}
+
+void table_free(Table **t) {
+  buf_free(&((*t)->keys));
+  free((*t)->slots);
+  free((*t)->offs);
+  free((*t)->lens);
+  free(*t);
+  *t = NULL;
+}
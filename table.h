@@ -0,0 +1,35 @@
+/*
+ * hash tables
+ *****************************************************************************/
+
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdlib.h>
+#include "buffer.h"
+#include "util.h"
+
+typedef struct Table {
+  Buffer *keys;
+  size_t *offs;
+  size_t *lens;
+  size_t *slots;
+  size_t count;
+  size_t size;
+} Table;
+
+uint64_t hash_bytes(const char *s, size_t len);
+
+size_t table_get(Table *t, const char *key, size_t len);
+
+size_t table_put(Table *t, const char *key, size_t len);
+
+const char *table_key(Table *t, size_t i);
+
+size_t table_len(Table *t, size_t i);
+
+void table_alloc(Table **t, size_t size);
+
+void table_free(Table **t);
+
+#endif
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Encodes a stream of JSON forms as MessagePack or CBOR, for the binary input
+# tests and benchmarks: encode.py msgpack|cbor < in.json > out
+
+import json
+import struct
+import sys
+
+def msgpack(x, out):
+    if x is None:
+        out.append(b'\xc0')
+    elif x is True or x is False:
+        out.append(b'\xc3' if x else b'\xc2')
+    elif isinstance(x, int):
+        if 0 <= x < 128:
+            out.append(struct.pack('B', x))
+        elif -32 <= x < 0:
+            out.append(struct.pack('b', x))
+        elif 0 <= x < 2**64:
+            out.append(b'\xcf' + struct.pack('>Q', x))
+        else:
+            out.append(b'\xd3' + struct.pack('>q', x))
+    elif isinstance(x, float):
+        out.append(b'\xcb' + struct.pack('>d', x))
+    elif isinstance(x, str):
+        s = x.encode('utf-8', 'surrogatepass')
+        if len(s) < 32:
+            out.append(struct.pack('B', 0xa0 | len(s)))
+        elif len(s) < 256:
+            out.append(b'\xd9' + struct.pack('B', len(s)))
+        else:
+            out.append(b'\xdb' + struct.pack('>I', len(s)))
+        out.append(s)
+    elif isinstance(x, list):
+        out.append(b'\xdd' + struct.pack('>I', len(x)))
+        for v in x:
+            msgpack(v, out)
+    else:
+        out.append(b'\xdf' + struct.pack('>I', len(x)))
+        for k, v in x.items():
+            msgpack(k, out)
+            msgpack(v, out)
+
+def cbor_head(major, n, out):
+    if n < 24:
+        out.append(struct.pack('B', major << 5 | n))
+    elif n < 2**8:
+        out.append(struct.pack('>BB', major << 5 | 24, n))
+    elif n < 2**16:
+        out.append(struct.pack('>BH', major << 5 | 25, n))
+    elif n < 2**32:
+        out.append(struct.pack('>BI', major << 5 | 26, n))
+    else:
+        out.append(struct.pack('>BQ', major << 5 | 27, n))
+
+def cbor(x, out):
+    if x is None:
+        out.append(b'\xf6')
+    elif x is True or x is False:
+        out.append(b'\xf5' if x else b'\xf4')
+    elif isinstance(x, int):
+        cbor_head(0, x, out) if x >= 0 else cbor_head(1, -1 - x, out)
+    elif isinstance(x, float):
+        out.append(b'\xfb' + struct.pack('>d', x))
+    elif isinstance(x, str):
+        s = x.encode('utf-8', 'surrogatepass')
+        cbor_head(3, len(s), out)
+        out.append(s)
+    elif isinstance(x, list):
+        cbor_head(4, len(x), out)
+        for v in x:
+            cbor(v, out)
+    else:
+        cbor_head(5, len(x), out)
+        for k, v in x.items():
+            cbor(k, out)
+            cbor(v, out)
+
+def main():
+    encode = {'msgpack': msgpack, 'cbor': cbor}[sys.argv[1]]
+    text = sys.stdin.read()
+    decoder = json.JSONDecoder()
+    pos = 0
+    while True:
+        while pos < len(text) and text[pos].isspace():
+            pos += 1
+        if pos == len(text):
+            break
+        x, pos = decoder.raw_decode(text, pos)
+        out = []
+        encode(x, out)
+        sys.stdout.buffer.write(b''.join(out))
+
+main()
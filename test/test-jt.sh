@@ -211,8 +211,428 @@ assert $LINENO \
 EOT
 )"
 
+assert $LINENO \
+  "$(echo "$JSON" | $jt -r [ foo + bar % ] [ baz % ])" \
+  "$(cat <<'EOT'
+100	200
+200	300
+300	400
+EOT
+)"
+
 assert $LINENO \
   "$(echo '{}' |$jt . % && echo OK)" \
   OK
 
+JSON='{"a":[{"x":1},{"x":2}],"b":[{"y":3},{"z":4}],"c":[{"z":5},{"z":6}]}'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt [ a x % ] [ b y % ] c z %)" \
+  "$(cat <<'EOT'
+1	3	5
+1	3	6
+1		5
+1		6
+2	3	5
+2	3	6
+2		5
+2		6
+EOT
+)"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -j [ a x % ] [ b y % ] c z %)" \
+  "$(cat <<'EOT'
+1	3	5
+1	3	6
+2	3	5
+2	3	6
+EOT
+)"
+
+JSON=$(cat <<'EOT'
+{"foo":"a","bar":{"x":"b"},"baz":[{"y":"c"},{"y":"d","z":"e"}]}
+{"foo":1,"bar":null,"%":[true,false]}
+EOT
+)
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -k)" \
+  "$(cat <<'EOT'
+	2	object
+foo	2	string,number
+bar	2	object,null
+bar x	1	string
+baz	2	object
+baz y	2	string
+baz z	1	string
+[%]	2	boolean
+EOT
+)"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -a -k)" \
+  "$(cat <<'EOT'
+	2	object
+foo	2	string,number
+bar	2	object,null
+bar x	1	string
+baz	1	array
+baz .	2	object
+baz . y	2	string
+baz . z	1	string
+[%]	1	array
+[%] .	2	boolean
+EOT
+)"
+
+JSON='{"a":[{"x":1},{"x":2}],"b":{"x":3},"c":[{"x":4}],"d":{"y":5},"e":{"x":6}}'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -p 2 . ^ x %)" \
+  "$(cat <<'EOT'
+0	1
+1	2
+b	3
+0	4
+d	
+e	6
+EOT
+)"
+
+assert $LINENO \
+  "$(echo '[1,2,3,4,5,6,7,8 9]' | $jt -p 2 % 2>&1)" \
+  "jt: can't parse JSON at byte 17"
+
+JSON=$(printf '{"a":"\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"}\n{"a":"\xed\xa0\x80"}')
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt a % 2>/dev/null)" \
+  "$(printf '\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80')"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt a % 2>&1 >/dev/null)" \
+  "jt: invalid UTF-8 at byte 24"
+
+assert $LINENO \
+  "$(for i in test/fail3[4-8].json; do $jt -T % < $i >/dev/null 2>&1 || echo $i; done)" \
+  ""
+
+# Strings are unescaped for CSV but not for TSV, and collections are minified
+# in both, with quotes doubled for CSV.
+JSON='{"q":"a\"b","u":"\u00e9\u20AC\ud83d\ude00\u0022","c":"x\ty\nz\\\/\b\f\r","l":"0123456789abcdef\"0123456789\u0041","o":{ "k" : [ 1, "a b\"c" , {"d" : "\"\\" } ] }}'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt [ q % ] [ u % ] [ c % ] [ l % ] o %)" \
+  "$(cat <<'EOT'
+a\"b	\u00e9\u20AC\ud83d\ude00\u0022	x\ty\nz\\\/\b\f\r	0123456789abcdef\"0123456789\u0041	{"k":[1,"a b\"c",{"d":"\"\\"}]}
+EOT
+)"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -c [ q % ] [ u % ] [ c % ] [ l % ] o %)" \
+  "$(printf '"a""b","\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80""","x\ty\nz\\/\b\f\r","0123456789abcdef""0123456789A","{""k"":[1,""a b\\""c"",{""d"":""\\""\\\\""}]}"')"
+
+JSON='{ "a" : [ 1, { "b\\" : "x \" y" } ], "c" : {"d":[]} }'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt [ c % ] %)" \
+  "$(cat <<'EOT'
+{"d":[]}	{"a":[1,{"b\\":"x \" y"}],"c":{"d":[]}}
+EOT
+)"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -c [ c % ] %)" \
+  "$(cat <<'EOT'
+"{""d"":[]}","{""a"":[1,{""b\\"":""x \"" y""}],""c"":{""d"":[]}}"
+EOT
+)"
+
+JSON='{"a":[{"x":1,"y":"p"},{"x":2,"y":"q"},{"x":3,"y":"p"},{"x":4,"y":"p"}]}'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -S a [ x %=x ] y %)" \
+  "$(cat <<'EOT'
+x	count	4
+x	distinct	4
+x	numbers	4
+x	min	1
+x	p25	1
+x	p50	2
+x	p75	3
+x	p90	4
+x	p99	4
+x	max	4
+x	top	1	1	0
+x	top	2	1	0
+x	top	3	1	0
+x	top	4	1	0
+2	count	4
+2	distinct	2
+2	top	p	3	0
+2	top	q	1	0
+EOT
+)"
+
+assert $LINENO \
+  "$(printf '{"a":1,"b":"x"}\n{"b":"y"}\n' | $jt -S [ a %=a ] b %=b | grep -e count -e top)" \
+  "$(printf 'a\tcount\t2\na\ttop\t1\t1\t0\na\ttop\t\t1\t0\nb\tcount\t2\nb\ttop\tx\t1\t0\nb\ttop\ty\t1\t0')"
+
+assert $LINENO \
+  "$(echo '[1, 1.00, 10e-1, -0.0, 0.1e1, 1.5E300, 1e999, 0.30000000000000004]' | $jt -C % | tr '\n' ' ')" \
+  "1 1 1 -0 1 1.5e+300 1e999 0.30000000000000004 "
+
+assert $LINENO \
+  "$(echo '{"a": [ 1.50, {"b": 2e2} ]}' | $jt -aC [ a % ] %)" \
+  "$(printf '[1.5,{"b":200}]\t{"a":[1.5,{"b":200}]}')"
+
+JSON=$(for i in 0 1 2 3 4 5 6 7 8 9; do echo "{\"a\":$i}"; done)
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -n 3 a %=a | tr '\n' ' ')" \
+  "a 0 1 2 "
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -P a % | tr '\n' ' ') $(echo "$JSON" | $jt -P -n 2 a % | tr '\n' ' ')" \
+  "0 1 2 3 4 5 6 7 8 9  0 1 "
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt --sample 4 a % | tr '\n' ' ')" \
+  "0 4 8 "
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt --reservoir 4 a % | sort -n -c && echo "$JSON" | $jt --reservoir 4 a % | wc -l)" \
+  "4"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt --reservoir 20 a % | tr '\n' ' ')" \
+  "0 1 2 3 4 5 6 7 8 9 "
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt --sample 2 --reservoir 3 a % 2>&1)" \
+  "jt: can't use --sample with --reservoir"
+
+assert $LINENO \
+  "$(echo '{"b":{"c":1},"a":2,"b":3,"c":[{"a":4},{"b":5}]}' | $jt -a [ b c % ] [ a % ] [ c 1 b % ] b %)" \
+  "$(printf '1\t2\t5\t{"c":1}')"
+
+# Looking up an index in an empty array finds nothing.
+assert $LINENO \
+  "$(echo '{"a":[],"b":1}' | $jt -a [ a 0 % ] b %; echo '{"a":[],"b":1}' | $jt -aj [ a 0 % ] b %)" \
+  "$(printf '\t1')"
+
+assert $LINENO \
+  "$(echo '{"x":1,"y":2}' | $jt [ x % ] y %=y)" \
+  "$(printf '\ty\n1\t2')"
+
+JSON=$(printf '{"a":"b","n":10}\n{"a":"c","n":2}\n{"n":5}\n{"a":"b","n":1}')
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt --sort 1,2n [ a %=a ] n %=n | tr '\n' ' ')" \
+  "$(printf 'a\tn \t5 b\t1 b\t10 c\t2 ')"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -n 2 --sort-memory 1 --sort 2n [ a % ] n % | tr '\n' ' ')" \
+  "$(printf 'b\t1 c\t2 ')"
+
+JSON='{"id":1,"a":{"id":2,"b":[{"id":3},{"x":{"id":{"id":4}}}]},"c":"id"}'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt '**' id % | tr '\n' ' ')" \
+  '1 2 3 {"id":4} 4 '
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt [ c % ] a '**' id % | tr '\n' ' ') $(echo "$JSON" | $jt -j [ c % ] '**' no %)" \
+  "$(printf 'id\t2 id\t3 id\t{"id":4} id\t4  ')"
+
+assert $LINENO \
+  "$(printf '%s\n' '"a\tb"' 'i love music \u266A' '""' '\"x\"' | $jt -c -u -)" \
+  "$(printf '"a\tb"\n"i love music \xe2\x99\xaa"\n""\n"""x"""')"
+
+assert $LINENO \
+  "$(printf '%s\n' '{"a":{"b":[1,"x"],"c/d~":{}},"e":[]}' '"s"' | $jt --flatten)" \
+  "$(cat <<'EOT'
+0	/a/b/0	1
+0	/a/b/1	x
+0	/a/c~1d~0	{}
+0	/e	[]
+1		s
+EOT
+)"
+
+# {"a":"x\"y","n":-3,"f":1.5,"l":[1,true,null]} in MessagePack, twice, and
+# {"a":[1,1.5],1:h'010203'} in CBOR, with an indefinite array and a half float.
+MSGPACK='\x84\xa1a\xa3x"y\xa1n\xfd\xa1f\xcb\x3f\xf8\x00\x00\x00\x00\x00\x00\xa1l\x93\x01\xc3\xc0'
+CBOR='\xa2\x61a\x9f\x01\xf9\x3e\x00\xff\x01\x43\x01\x02\x03'
+
+assert $LINENO \
+  "$(printf "$MSGPACK$MSGPACK" | $jt --format msgpack [ a % ] [ n % ] [ f % ] [ l % ]; printf "$CBOR" | $jt --format cbor % 1 %)" \
+  "$(cat <<'EOT'
+x\"y	-3	1.5	1
+x\"y	-3	1.5	true
+x\"y	-3	1.5	null
+x\"y	-3	1.5	1
+x\"y	-3	1.5	true
+x\"y	-3	1.5	null
+{"a":[1,1.5],"1":"AQID"}	AQID
+EOT
+)"
+
+# ["a","b"] in CBOR is also a valid MessagePack map, so binary input is only
+# detected from the self-described CBOR tag or a MessagePack map16 or array16,
+# and otherwise it needs --format.
+assert $LINENO \
+  "$(printf '\x82\x61a\x61b' | $jt % 2>&1; printf '\x82\x61a\x61b' | $jt --format cbor %)" \
+  "$(printf 'jt: ambiguous binary input, use --format\na\nb')"
+
+assert $LINENO \
+  "$(printf '\xd9\xd9\xf7\x82\x61a\x61b' | $jt %; printf '\xde\x00\x01\xa1a\x01' | $jt a %)" \
+  "$(printf 'a\nb\n1')"
+
+# A map of two pairs that ends after the first key.
+assert $LINENO \
+  "$(printf '\x82\xa1a' | $jt -t --format msgpack a % 2>&1)" \
+  "jt: can't decode MessagePack or CBOR at byte 3"
+
+# A byte order mark is JSON, which jt doesn't accept, not MessagePack.
+assert $LINENO \
+  "$(printf '\xef\xbb\xbf{"a":1}\n' | $jt % 2>&1)" \
+  "jt: can't parse JSON at byte 0"
+
+# Batches of two give the same rows as form by form, with arrays iterated at a
+# `%`, nested ones run form by form, and a bad form in the middle of a batch.
+BATCH=$(printf '%s\n' '{"a":[1,2],"b":{"c":"x"}}' '{"a":3}' '{"a":[[4],5],"b":[]}' 'x' '{"b":{"c":"y"}}')
+
+assert $LINENO \
+  "$(for o in -t -tj; do echo "$BATCH" | $jt $o --batch 2 [ a % ] ^ [ b c % ] 2>&1; done)" \
+  "$(printf 'jt: skipped 1 bad records\n1\t0\tx\n2\t1\tx\n3\t1\t\n4\t0\t\n5\t1\t\n\t3\ty\n')
+$(printf 'jt: skipped 1 bad records\n1\t0\tx\n2\t1\tx')"
+
+# In line mode a row must come out within 500ms of its record, while the
+# input is still open.
+assert $LINENO \
+  "$({ echo '{"a":1}'; sleep 1; echo '{"a":2}'; } | $jt -l a % | { read -t 0.5 x; echo "$x"; cat > /dev/null; })" \
+  "1"
+
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT
+
+JSON='{"foo":"a","bar":{"x":"b"},"baz":[{"y":"c"},{"y":"d","z":"e"}]}'
+
+JSON=$(printf '{"a":1}\n{"a":2,\n{"a":3} {"a":\n{"a":"\xc3"}\n{"a":5}')
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -t -e $TMP/rej a % 2>&1 && cat $TMP/rej)" \
+  "$(cat <<'EOT'
+jt: skipped 3 bad records
+1
+3
+5
+8
+24
+30
+EOT
+)"
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -P -t a % 2>&1 | tr '\n' ' ')" \
+  "jt: skipped 3 bad records 1 3 5 "
+
+JSON='{"foo":"a","bar":{"x":"b"},"baz":[{"y":"c"},{"y":"d","z":"e"}]}'
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt [ foo % ] bar x % ">$TMP/1" baz y %=y ">$TMP/2" ^ && cat $TMP/1 $TMP/2)" \
+  "$(cat <<'EOT'
+0
+a	b
+y
+c
+d
+EOT
+)"
+
+cat > $TMP/prog <<'EOT'
+# one program per line
+[ foo % ] bar x %
+baz ^ y %
+EOT
+
+assert $LINENO \
+  "$(echo "$JSON" | $jt -f $TMP/prog foo %)" \
+  "$(cat <<'EOT'
+a	b
+0	c
+1	d
+a
+EOT
+)"
+
+for i in 1 2 3; do
+  for j in 1 2 3; do echo "{\"a\":$i$j}"; done > $TMP/in$i
+done
+
+assert $LINENO \
+  "$($jt --jobs 2 ^ a % -- $TMP/in1 $TMP/in2 $TMP/in3 | tr '\n' ' ')" \
+  "$(printf '0\t11 1\t12 2\t13 0\t21 1\t22 2\t23 0\t31 1\t32 2\t33 ')"
+
+assert $LINENO \
+  "$($jt -c --filename a %=a -- $TMP/in2 | head -2 | tr '\n' ' ')" \
+  "\"file\",\"a\" \"$TMP/in2\",\"21\" "
+
+assert $LINENO \
+  "$($jt --jobs 3 --interleave a % -- $TMP/in1 $TMP/in2 $TMP/in3 | sort | tr '\n' ' ')" \
+  "11 12 13 21 22 23 31 32 33 "
+
+echo '{"a":1}' > $TMP/log
+$jt -F $TMP/log a % > $TMP/follow &
+pid=$!
+sleep 0.3; echo '{"a":2}' >> $TMP/log
+sleep 0.3; mv $TMP/log $TMP/log.1; echo '{"a":3}' > $TMP/log
+sleep 0.3; : > $TMP/log
+sleep 0.3; echo '{"a":4}' >> $TMP/log
+sleep 0.3; kill $pid
+
+assert $LINENO \
+  "$(cat $TMP/follow | tr '\n' ' ')" \
+  "1 2 3 4 "
+
+# Rows with the same value in the key column go to the same shard.
+assert $LINENO \
+  "$(printf '{"a":%d}\n' 1 2 3 4 1 2 3 4 | $jt --shards 2 --shard-files $TMP/shard-%d.tsv [ a %=a ] \
+     && for f in $TMP/shard-*.tsv; do sed 1d $f | sort -u; done | sort | tr '\n' ' ')" \
+  "$(for f in $TMP/shard-*.tsv; do sed 1d $f | sort | uniq -d; done | sort | tr '\n' ' ')"
+
+echo "$JSON" > $TMP/cached.json
+
+assert $LINENO \
+  "$(for i in 1 2; do $jt --stats --cache $TMP/cache baz y % < $TMP/cached.json 2>&1; done)" \
+  "$(cat <<EOT
+jt: read 1 forms
+jt: cache miss, written: $TMP/cache
+c
+d
+jt: read 1 forms
+jt: cache hit: $TMP/cache
+c
+d
+EOT
+)"
+
+# An edit in the middle of the input that keeps its size and modification
+# time is still noticed.
+seq 100000 199999 | sed 's/.*/{"a":&}/' > $TMP/cached.json
+$jt --cache $TMP/cache a % < $TMP/cached.json > /dev/null
+touch -r $TMP/cached.json $TMP/stamp
+sed -i 's/{"a":150000}/{"a":999999}/' $TMP/cached.json
+touch -r $TMP/stamp $TMP/cached.json
+
+assert $LINENO \
+  "$($jt --stats --cache $TMP/cache a % < $TMP/cached.json 2>&1 | grep -e cache -e 999999 | sort)" \
+  "$(cat <<EOT
+999999
+jt: cache miss, written: $TMP/cache
+EOT
+)"
+
 [[ $fails == 0 ]] || exit 1
@@ -0,0 +1,132 @@
+/*
+ * tests for the library interface (see README.md)
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "jt.h"
+
+static int fails = 0;
+
+#define check(cond) result(__LINE__, (cond), #cond)
+
+static void result(int line, int ok, const char *what) {
+  printf("\033[1mL%-4d%35s\033[0m  %s\n", line, "",
+         ok ? "\033[1;32mPASS\033[0m" : "\033[1;31mFAIL\033[0m");
+  if (!ok) {
+    fails++;
+    printf("%s\n", what);
+  }
+}
+
+// Rows are copied, since they're only valid until the callback returns.
+
+static void add_row(void *ctx, const char *row, size_t len) {
+  buf_append(ctx, row, len);
+  buf_write(ctx, '\n');
+}
+
+// Counts the empty columns of each row, which are passed as token 0.
+
+static void count_empty(void *ctx, jsparser_t *p, const size_t *toks, int n) {
+  for (int i = 0; i < n; i++)
+    if (!toks[i]) (*(int *) ctx)++;
+}
+
+// The records are fed three bytes at a time, so most of them are split
+// between chunks, and two queries run over the same parser.
+
+static void test_feed() {
+  char *q1[] = {"[", "a", "%", "]", "b", "%"}, *q2[] = {"b", "%"};
+  Buffer *in, *out1, *out2, *want1, *want2;
+  jserr_t err, last;
+  size_t i, maxpos = 0;
+  int emore = 1;
+  jsparser_t *p;
+  jt_t *jtv[2];
+  char rec[64];
+
+  buf_alloc(&in);
+  buf_alloc(&out1);
+  buf_alloc(&out2);
+  buf_alloc(&want1);
+  buf_alloc(&want2);
+
+  for (i = 0; i < 200; i++) {
+    snprintf(rec, sizeof(rec), "{\"a\":[%zu,%zu],\"b\":\"x%zu\"}\n", i, i + 1, i);
+    buf_append(in, rec, strlen(rec));
+    snprintf(rec, sizeof(rec), "%zu\tx%zu\n%zu\tx%zu\n", i, i, i + 1, i);
+    buf_append(want1, rec, strlen(rec));
+    snprintf(rec, sizeof(rec), "\"x%zu\"\n", i);
+    buf_append(want2, rec, strlen(rec));
+  }
+
+  js_alloc(&p, NULL, 128);
+  check(jt_alloc(jtv, 6, q1, 0, add_row, out1) == JT_OKAY);
+  check(jt_alloc(jtv + 1, 2, q2, JT_CSV, add_row, out2) == JT_OKAY);
+
+  for (i = 0; i < in->pos; i += 3) {
+    js_feed(p, in->buf + i, (in->pos - i < 3) ? in->pos - i : 3);
+    if ((err = jt_exec(jtv, 2, p)) != JS_EMORE) emore = 0;
+    if ((p->js)->pos > maxpos) maxpos = (p->js)->pos;
+  }
+
+  js_finish(p);
+  last = jt_exec(jtv, 2, p);
+
+  check(emore);
+  check(last == JS_EDONE);
+  check(maxpos < 64);
+  check(out1->pos == want1->pos && !strcmp(out1->buf, want1->buf));
+  check(out2->pos == want2->pos && !strcmp(out2->buf, want2->buf));
+
+  jt_free(jtv);
+  jt_free(jtv + 1);
+  js_free(&p);
+  buf_free(&in);
+  buf_free(&out1);
+  buf_free(&out2);
+  buf_free(&want1);
+  buf_free(&want2);
+}
+
+static void test_cols() {
+  char *q[] = {"[", "a", "%", "]", "c", "%"}, *in = "{\"a\":1}\n{\"c\":2}\n";
+  jsparser_t *p;
+  int empty = 0;
+  jt_t *jt;
+
+  js_alloc(&p, NULL, 128);
+  check(jt_alloc(&jt, 6, q, 0, NULL, NULL) == JT_OKAY);
+  jt->cols = count_empty;
+  jt->cols_ctx = &empty;
+
+  js_feed(p, in, strlen(in));
+  js_finish(p);
+
+  check(jt_exec(&jt, 1, p) == JS_EDONE);
+  check(empty == 2);
+
+  jt_free(&jt);
+  js_free(&p);
+}
+
+// A query that can't be run is reported to the caller.
+
+static void test_errors() {
+  char *q1[] = {"[", "a", "]", "]"}, *q2[] = {"a", "**"}, *q3[] = {"**", "]", "%"};
+  jt_t *jt = (jt_t *) 1;
+
+  check(jt_alloc(&jt, 4, q1, 0, add_row, NULL) == JT_EBRACKET && !jt);
+  check(jt_alloc(&jt, 2, q2, 0, add_row, NULL) == JT_EKEY && !jt);
+  check(!strcmp(jt_error(JT_EBRACKET), "unmatched ]"));
+  check(jt_alloc(&jt, 3, q3, 0, add_row, NULL) == JT_OKAY && jt);
+  jt_free(&jt);
+}
+
+int main() {
+  test_feed();
+  test_cols();
+  test_errors();
+  return fails ? 1 : 0;
+}
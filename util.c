@@ -4,20 +4,6 @@
 
 #include "util.h"
 
-int is_digit_char(char x) {
-  return ('0' <= x && x <= '9');
-}
-
-int is_hex_char(char x) {
-  return (('0' <= x && x <= '9') ||
-          ('a' <= x && x <= 'f') ||
-          ('A' <= x && x <= 'F'));
-}
-
-int is_ws_char(char x) {
-  return (x == ' ' || x == '\t' || x == '\r' || x == '\n');
-}
-
 size_t strtosizet(const char *s) {
   size_t ret = 0;
   for (; *s != '\0'; s++) {
@@ -74,3 +60,39 @@ void *jrealloc(void *ptr, size_t size) {
   if (! (ret = realloc(ptr, size))) die_mem();
   return ret;
 }
+
+// Finds column col (counting from zero) of a row of output, where a CSV
+// field is returned without its quotes (doubled quotes inside it are left as
+// they are). A missing column is empty.
+
+void row_field(const char *row, size_t len, int col, int csv,
+               const char **f, size_t *flen) {
+  const char *end = row + len, *s = row, *start, *stop, *q;
+  int i;
+
+  for (i = 0; ; i++) {
+    if (csv && s < end && *s == '\"') {
+      for (q = s + 1; q < end && !(*q == '\"' && (q + 1 == end || q[1] != '\"'));
+           q += (*q == '\"') ? 2 : 1);
+      start = s + 1;
+      stop = q < end ? q : end;
+      q = stop < end ? stop + 1 : end;
+    } else {
+      q = memchr(s, csv ? ',' : '\t', end - s);
+      start = s;
+      stop = q = q ? q : end;
+    }
+
+    if (i == col) {
+      *f = start;
+      *flen = stop - start;
+      return;
+    }
+
+    if (q >= end) break;
+    s = q + 1;
+  }
+
+  *f = end;
+  *flen = 0;
+}
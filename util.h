@@ -12,14 +12,28 @@
 #include <string.h>
 #include <unistd.h>
 
-int is_digit_char(char x);
+// The character classes are used in the parser's inner loops, so they're
+// defined here where they can be inlined.
 
-int is_hex_char(char x);
+static inline int is_digit_char(char x) {
+  return ('0' <= x && x <= '9');
+}
 
-int is_ws_char(char x);
+static inline int is_hex_char(char x) {
+  return (('0' <= x && x <= '9') ||
+          ('a' <= x && x <= 'f') ||
+          ('A' <= x && x <= 'F'));
+}
+
+static inline int is_ws_char(char x) {
+  return (x == ' ' || x == '\t' || x == '\r' || x == '\n');
+}
 
 size_t strtosizet(const char *s);
 
+void row_field(const char *row, size_t len, int col, int csv,
+               const char **f, size_t *flen);
+
 void warn(const char *fmt, ...);
 
 void die(const char *fmt, ...);